@@ -0,0 +1,119 @@
+// Checks that a training step doesn't allocate once the shapes are known:
+// global operator new is hooked and counts, after a couple of steps to size
+// the buffers, forward + cost + backprop must count none.
+//
+//   g++ -O2 -std=c++17 -pthread check_alloc.cpp -o check_alloc
+//   ./check_alloc
+//
+// Exits with 1 if a step allocated.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <new>
+#include <atomic>
+#include <vector>
+#include <string>
+
+#include "matrix.hpp"
+#include "nn.hpp"
+
+static std::atomic<long> allocations{ 0 };
+
+static void* counted_malloc(size_t size) {
+    allocations++;
+    void* p = malloc(size > 0 ? size : 1);
+    if (p == nullptr) throw std::bad_alloc();
+    return p;
+}
+
+void* operator new(size_t size) { return counted_malloc(size); }
+void* operator new[](size_t size) { return counted_malloc(size); }
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+
+// Allocations of `steps` steps of batch rows, after two to warm up.
+static long step_allocations(const std::vector<int>& layers, int batch, int steps) {
+    std::vector<std::string> labels;
+    for (int i = 0; i < layers.back(); i++) labels.push_back(std::to_string(i));
+    NN nn(layers, labels);
+    nn.reserve_batch(batch);
+
+    NN_Matrix input(batch, layers.front());
+    NN_Matrix expected(batch, layers.back());
+    input.randomize(0, 1);
+    for (int r = 0; r < batch; r++) expected.set(r, r % layers.back(), 1);
+
+    long before = 0;
+    float cost = 0;
+    for (int step = 0; step < steps + 2; step++) {
+        if (step == 2) before = allocations;
+        nn.forward(input);
+        cost += (nn.get_outputs() - expected).square().sum() / expected.cols();
+        nn.backprop(expected);
+    }
+    (void) cost;
+    return allocations - before;
+}
+
+// multiply_into() with a padded operand (as the weights are) either side,
+// checked against the lazy multiply(). Once dst is sized, the same products
+// don't allocate.
+static bool padded_multiply() {
+    NN_Matrix w, v(4, 20), dst;
+    w.init_padded(4, 20);
+    w.randomize(-1, 1);
+    v.randomize(-1, 1);
+    const NN_Matrix expected = w.multiply(v);
+
+    bool same = true;
+    long before = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        if (pass == 1) before = allocations;
+        for (int order = 0; order < 2; order++) {
+            if (order == 0) w.multiply_into(v, dst);
+            else v.multiply_into(w, dst);
+            for (int r = 0; r < 4; r++) {
+                for (int c = 0; c < 20; c++) {
+                    if (dst.at(r, c) != expected.at(r, c)) same = false;
+                }
+            }
+        }
+    }
+    long count = allocations - before;
+    printf("padded multiply_into(): %s, %ld allocations\n", same ? "the same" : "DIFFERENT", count);
+    return same && count == 0;
+}
+
+int main() {
+    struct Case { std::vector<int> layers; int batch; };
+    const Case cases[] = {
+        { { 784, 20, 10, 10 }, 1 },
+        { { 784, 512, 512, 10 }, 1 },
+        // Wide enough for the column shards of the pool.
+        { { 784, 2048, 10 }, 4 },
+        { { 784, 20, 10, 10 }, 16 },
+    };
+
+    // Or everything would pass.
+    long probe = allocations;
+    delete new std::vector<int>(1);
+    if (allocations == probe) {
+        printf("FAILED: operator new isn't hooked\n");
+        return 1;
+    }
+
+    bool ok = true;
+    for (const Case& c : cases) {
+        std::string name;
+        for (int neurons : c.layers) name += (name.empty() ? "" : "-") + std::to_string(neurons);
+        long count = step_allocations(c.layers, c.batch, 20);
+        printf("%s, batch %d: %ld allocations in 20 steps\n", name.c_str(), c.batch, count);
+        if (count != 0) ok = false;
+    }
+    if (!padded_multiply()) ok = false;
+
+    printf(ok ? "ok\n" : "FAILED: a training step allocates\n");
+    return ok ? 0 : 1;
+}
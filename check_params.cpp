@@ -0,0 +1,192 @@
+// Checks the one buffer the parameters of a NN live in (see NN::params):
+// - the biases and the weights of every layer are views into it, one part
+//   after the other, each NN_ALIGN aligned, the rows of the weights padded;
+// - the gradients of a workspace are laid out the same;
+// - apply_gradients() over the whole buffer gives the same weights, bit for
+//   bit, as a step of every layer's matrices, and leaves the padding zero;
+// - save() and load() give back the same network, and the files from
+//   before it, a matrix after the other, still load.
+//
+//   g++ -O2 -std=c++17 -pthread check_params.cpp -o check_params
+//   ./check_params
+//
+// Writes a file in the current directory. Exits with 1 on a wrong layout
+// or different weights.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "nn.hpp"
+
+static bool failed = false;
+
+static void check(bool ok, const char* what) {
+    printf("%s: %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok) failed = true;
+}
+
+static bool same_values(const NN_Matrix& a, const NN_Matrix& b) {
+    if (a.rows() != b.rows() || a.cols() != b.cols()) return false;
+    for (int r = 0; r < a.rows(); r++) {
+        if (memcmp(a.row(r), b.row(r), a.cols() * sizeof(matrix_t)) != 0) return false;
+    }
+    return true;
+}
+
+static bool same_weights(const NN& a, const NN& b) {
+    if (a.layers.size() != b.layers.size()) return false;
+    for (size_t i = 0; i < a.layers.size(); i++) {
+        if (!same_values(a.layers[i].biased, b.layers[i].biased)) return false;
+        if (!same_values(a.layers[i].weights, b.layers[i].weights)) return false;
+    }
+    return true;
+}
+
+// Every part in order from the start of base, aligned, inside it and with
+// the shapes of the layers of nn.
+static bool laid_out(const NN& nn, const matrix_t* base, size_t size,
+                     const std::vector<const NN_Matrix*>& parts) {
+    size_t next = 0;
+    for (size_t p = 0; p < parts.size(); p++) {
+        const NN_Matrix& m = *parts[p];
+        const Layer& layer = nn.layers[p / 2];
+        const bool weights = p % 2 == 1;
+        if (weights && m.rows() == 0) continue;
+        size_t offset = m.data().data() - base;
+        if (offset < next || offset % NN_ALIGN_FLOATS != 0) return false;
+        if (weights) {
+            if (m.rows() != layer.weights.rows() || m.cols() != layer.weights.cols()) return false;
+            if (m.stride() != (int) nn_align_up(m.cols(), NN_ALIGN_FLOATS)) return false;
+        } else if (m.rows() != 1 || m.cols() != layer.biased.cols()) {
+            return false;
+        }
+        next = offset + NN_Matrix::view_size(m.rows(), m.cols(), weights);
+        if (next > size) return false;
+    }
+    return true;
+}
+
+static std::vector<const NN_Matrix*> param_parts(const NN& nn) {
+    std::vector<const NN_Matrix*> parts;
+    for (const Layer& layer : nn.layers) {
+        parts.push_back(&layer.biased);
+        parts.push_back(&layer.weights);
+    }
+    return parts;
+}
+
+static std::vector<const NN_Matrix*> gradient_parts(const NN_Workspace& ws) {
+    std::vector<const NN_Matrix*> parts;
+    for (size_t i = 0; i < ws.grad_biased.size(); i++) {
+        parts.push_back(&ws.grad_biased[i]);
+        parts.push_back((i < ws.grad_weights.size()) ? &ws.grad_weights[i] : nullptr);
+    }
+    parts.pop_back();
+    return parts;
+}
+
+// The values of params outside of the parts, which no step should touch.
+static bool padding_zero(const NN& nn) {
+    const matrix_t* base = nn.params.data().data();
+    std::vector<bool> used(nn.params.data().size(), false);
+    for (const NN_Matrix* m : param_parts(nn)) {
+        for (int r = 0; r < m->rows(); r++) {
+            size_t offset = m->row(r) - base;
+            for (int c = 0; c < m->cols(); c++) used[offset + c] = true;
+        }
+    }
+    for (size_t i = 0; i < used.size(); i++) {
+        if (!used[i] && base[i] != 0) return false;
+    }
+    return true;
+}
+
+// A file as NN::save() wrote them before params: trained, data_index, the
+// layer count, then the biases and the weights of every layer, each its
+// rows, its cols and its values without the padding.
+static void save_old_format(const NN& nn, const char* path) {
+    std::ofstream file(path, std::ios::binary);
+    file.write((const char*)(&nn.trained), sizeof nn.trained);
+    file.write((const char*)(&nn.data_index), sizeof nn.data_index);
+    int layer_count = (int) nn.layers.size();
+    file.write((const char*)(&layer_count), sizeof layer_count);
+    for (const Layer& layer : nn.layers) {
+        for (const NN_Matrix* m : { &layer.biased, &layer.weights }) {
+            int rows = m->rows(), cols = m->cols();
+            file.write((const char*)(&rows), sizeof rows);
+            file.write((const char*)(&cols), sizeof cols);
+            for (int r = 0; r < rows; r++) file.write((const char*) m->row(r), cols * sizeof(matrix_t));
+        }
+    }
+}
+
+int main() {
+    // Widths which aren't a multiple of the alignment, so there's padding.
+    const std::vector<int> neurons = { 784, 30, 17, 10 };
+    const int batch = 8;
+    srand(0);
+    std::vector<std::string> labels;
+    for (int i = 0; i < neurons.back(); i++) labels.push_back(std::to_string(i));
+    NN nn(neurons, labels);
+
+    const matrix_t* base = nn.params.data().data();
+    const size_t size = nn.params.data().size();
+    check(size == NN::param_count(neurons) && (uintptr_t) base % NN_ALIGN == 0 &&
+          laid_out(nn, base, size, param_parts(nn)) && padding_zero(nn),
+          "layers are aligned views into params");
+
+    NN_Matrix input(batch, neurons.front()), expected(batch, neurons.back());
+    input.randomize(0, 1);
+    for (int r = 0; r < batch; r++) expected.set(r, r % neurons.back(), 1);
+
+    NN_Workspace ws;
+    nn.forward(input, ws);
+    nn.compute_gradients(expected, ws);
+    check(ws.grad_params.data().size() == size && (uintptr_t) ws.grad_params.data().data() % NN_ALIGN == 0 &&
+          laid_out(nn, ws.grad_params.data().data(), size, gradient_parts(ws)),
+          "gradients are laid out like params");
+
+    // A few steps, against the same steps a layer at a time.
+    NN by_layer;
+    nn.copy_to(by_layer);
+    const matrix_t scale = -nn.learn_rate / batch;
+    bool same = true;
+    for (int step = 0; step < 5; step++) {
+        nn.forward(input, ws);
+        nn.compute_gradients(expected, ws);
+        nn.apply_gradients(ws, scale);
+        for (size_t i = 0; i < by_layer.layers.size(); i++) {
+            by_layer.layers[i].biased += ws.grad_biased[i] * scale;
+            if (i < ws.grad_weights.size()) by_layer.layers[i].weights += ws.grad_weights[i] * scale;
+        }
+        if (!same_weights(nn, by_layer)) same = false;
+    }
+    check(same && padding_zero(nn), "apply_gradients() is the step of every layer");
+
+    nn.trained = 5 * batch;
+    nn.data_index = 17;
+    const char* path = "check_params.nn";
+    nn.save(path);
+    NN loaded;
+    loaded.load(path);
+    check(same_weights(nn, loaded) && loaded.trained == nn.trained && loaded.data_index == nn.data_index &&
+          loaded.params.data().size() == size && NN::saved_layers(path) == neurons,
+          "save() and load() round trip");
+
+    save_old_format(nn, path);
+    NN old;
+    old.load(path);
+    check(same_weights(nn, old) && old.trained == nn.trained && old.data_index == nn.data_index &&
+          laid_out(old, old.params.data().data(), old.params.data().size(), param_parts(old)) &&
+          NN::saved_layers(path) == neurons,
+          "the old files load");
+    remove(path);
+
+    printf(failed ? "FAILED\n" : "ok\n");
+    return failed ? 1 : 0;
+}
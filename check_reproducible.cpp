@@ -0,0 +1,228 @@
+// Checks that the parallel training paths which promise it give the same
+// weights bit for bit whatever the number of threads of the pool: each case
+// runs in a process of its own per pool size, forked before any thread is
+// started so it makes its own pool, and sends back a hash of the result.
+// The ranks of the process ring also have to agree with each other.
+//
+//   g++ -O2 -std=c++17 -pthread check_reproducible.cpp -o check_reproducible
+//   ./check_reproducible
+//
+// Exits with 1 if a case gives different results. Needs fork().
+
+#if !defined(__unix__)
+#error "check_reproducible.cpp needs fork()."
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <string>
+#include <vector>
+
+#include "nn.hpp"
+#include "dataset.hpp"
+#include "parallel.hpp"
+#include "data_parallel.hpp"
+#if defined(__linux__)
+#include <sys/mman.h>
+#include "process_ring.hpp"
+#endif
+
+// FNV-1a.
+static uint64_t hash_bytes(const void* data, size_t bytes, uint64_t hash = 14695981039346656037ull) {
+    const uint8_t* p = (const uint8_t*) data;
+    for (size_t i = 0; i < bytes; i++) hash = (hash ^ p[i]) * 1099511628211ull;
+    return hash;
+}
+
+static uint64_t matrix_hash(const NN_Matrix& m, uint64_t hash = 14695981039346656037ull) {
+    for (int r = 0; r < m.rows(); r++) hash = hash_bytes(m.row(r), m.cols() * sizeof(matrix_t), hash);
+    return hash;
+}
+
+static uint64_t weights_hash(const NN& nn) {
+    uint64_t hash = 14695981039346656037ull;
+    for (const Layer& layer : nn.layers) {
+        hash = matrix_hash(layer.biased, hash);
+        hash = matrix_hash(layer.weights, hash);
+    }
+    return hash;
+}
+
+// Made up samples, the same every time: inputs in [0, 1] and one of 10
+// classes.
+class DsSynthetic : public Dataset {
+public:
+    DsSynthetic(int count, int inputs) : _count(count), _inputs(inputs) {}
+
+    int count() const override { return _count; }
+
+    NN_Matrix get_input(int index) const override {
+        NN_Matrix m(1, _inputs);
+        for (int j = 0; j < _inputs; j++) m.set(0, j, ((index * 7919 + j * 104729) % 256) / 255.f);
+        return m;
+    }
+
+    NN_Matrix get_output(int index) const override {
+        NN_Matrix m(1, 10);
+        m.set(0, index % 10, 1);
+        return m;
+    }
+
+private:
+    int _count;
+    int _inputs;
+};
+
+static NN make_nn(const std::vector<int>& layers) {
+    srand(0);
+    std::vector<std::string> labels;
+    for (int i = 0; i < layers.back(); i++) labels.push_back(std::to_string(i));
+    NN nn(layers, labels);
+    nn.learn_rate = 0.1f;
+    return nn;
+}
+
+// Runs fn in a child process with a pool of threads, 0 if it failed.
+static uint64_t in_child(int threads, uint64_t (*fn)()) {
+    int fds[2];
+    if (pipe(fds) != 0) return 0;
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid < 0) return 0;
+    if (pid == 0) {
+        close(fds[0]);
+        parallel::Config config;
+        config.threads = threads;
+        parallel::configure(config);
+        uint64_t hash = fn();
+        ssize_t written = write(fds[1], &hash, sizeof hash);
+        _exit(written == (ssize_t) sizeof hash ? 0 : 1);
+    }
+
+    close(fds[1]);
+    uint64_t hash = 0;
+    if (read(fds[0], &hash, sizeof hash) != (ssize_t) sizeof hash) hash = 0;
+    close(fds[0]);
+    int status = 0;
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) hash = 0;
+    return hash;
+}
+
+// Two epochs of 4 replicas, see DataParallel.
+static uint64_t data_parallel() {
+    DsSynthetic dataset(2048, 784);
+    NN nn = make_nn({ 784, 64, 32, 10 });
+    DataParallel trainer(nn, 4);
+    std::vector<int> order(dataset.count());
+    for (int i = 0; i < (int) order.size(); i++) order[i] = i;
+    for (int epoch = 0; epoch < 2; epoch++) trainer.train_epoch(dataset, order, 32);
+    return weights_hash(nn);
+}
+
+// The gemms of wide layers, split in column shards by the pool (see
+// gemm::gemm()): every transpose, accumulating into C, with the bias and
+// sigmoid epilogue and a single row, then a few steps of a wide network.
+static uint64_t sharded_layers() {
+    const int m = 64, n = 2080, k = 512;
+    srand(1);
+    NN_Matrix a(m, k), at(k, m), b(k, n), bt(n, k), bias(1, n), x(1, k);
+    a.randomize(-1, 1);
+    at.randomize(-1, 1);
+    b.randomize(-1, 1);
+    bt.randomize(-1, 1);
+    bias.randomize(-1, 1);
+    x.randomize(-1, 1);
+
+    uint64_t hash = 14695981039346656037ull;
+    NN_Matrix c;
+    for (int t = 0; t < 4; t++) {
+        const bool ta = t & 1, tb = t & 2;
+        c.gemm(ta ? at : a, ta, tb ? bt : b, tb);
+        c.gemm(ta ? at : a, ta, tb ? bt : b, tb, .5f, 1);
+        hash = matrix_hash(c, hash);
+    }
+    c.linear_sigmoid(a, b, bias);
+    hash = matrix_hash(c, hash);
+    NN_Matrix y;
+    y.gemm(x, false, b, false);
+    hash = matrix_hash(y, hash);
+    y.gemm(x, false, bt, true);
+    hash = matrix_hash(y, hash);
+
+    DsSynthetic dataset(256, 784);
+    NN nn = make_nn({ 784, 2048, 10 });
+    NN_Matrix inputs, expected;
+    std::vector<int> indices(16);
+    for (int first = 0; first < dataset.count(); first += 16) {
+        for (int i = 0; i < 16; i++) indices[i] = first + i;
+        dataset.get_batch(indices, inputs, expected);
+        nn.forward(inputs);
+        nn.backprop(expected);
+    }
+    return hash_bytes(&hash, sizeof hash, weights_hash(nn));
+}
+
+#if defined(__linux__)
+// Two epochs over 3 processes, see RingTrainer. Every rank has to end with
+// the same weights, 0 otherwise.
+static uint64_t process_ring() {
+    DsSynthetic dataset(2048, 784);
+    const std::vector<int> layers = { 784, 64, 32, 10 };
+    const int ranks = 3;
+    uint64_t* hashes = (uint64_t*) mmap(NULL, ranks * sizeof(uint64_t), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (hashes == MAP_FAILED) return 0;
+
+    ShmRing ring(ranks, RingTrainer::ring_size(layers));
+    int rank = ring.fork_ranks();
+    NN nn = make_nn(layers);
+    RingTrainer trainer(nn, ring, rank);
+    const int shard_size = dataset.count() / ranks;
+    std::vector<int> shard(shard_size);
+    for (int i = 0; i < shard_size; i++) shard[i] = rank * shard_size + i;
+    for (int epoch = 0; epoch < 2; epoch++) trainer.train_epoch(dataset, shard, 32);
+    hashes[rank] = weights_hash(nn);
+    if (rank != 0) _exit(0);
+
+    bool same = ring.wait_ranks();
+    for (int r = 1; r < ranks; r++) {
+        if (hashes[r] != hashes[0]) same = false;
+    }
+    uint64_t hash = same ? hashes[0] : 0;
+    munmap(hashes, ranks * sizeof(uint64_t));
+    return hash;
+}
+#endif
+
+int main() {
+    struct Case { const char* name; uint64_t (*fn)(); };
+    const Case cases[] = {
+        { "data parallel, 4 replicas", data_parallel },
+        { "sharded wide layers", sharded_layers },
+#if defined(__linux__)
+        { "process ring, 3 ranks", process_ring },
+#endif
+    };
+    const int pool_sizes[] = { 1, 2, 4 };
+
+    bool ok = true;
+    for (const Case& c : cases) {
+        uint64_t first = 0;
+        bool same = true;
+        printf("%s:", c.name);
+        for (int threads : pool_sizes) {
+            uint64_t hash = in_child(threads, c.fn);
+            printf(" %d threads %016llx", threads, (unsigned long long) hash);
+            if (hash == 0 || (first != 0 && hash != first)) same = false;
+            if (first == 0) first = hash;
+        }
+        printf(same ? " | the same\n" : " | DIFFERENT\n");
+        if (!same) ok = false;
+    }
+
+    printf(ok ? "ok\n" : "FAILED\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,146 @@
+// Checks the sigmoid modes (see simd::SigmoidMode): the largest error of
+// every mode against a double precision sigmoid, for every instruction set
+// the CPU has and the scalar sigmoid(), then the test accuracy of a network
+// trained for an epoch with the exact one, run with each.
+//
+//   g++ -O2 -std=c++17 -pthread check_sigmoid.cpp -o check_sigmoid
+//   ./check_sigmoid [DIR]
+//
+// DIR has the MNIST idx files (./datasets). Exits with 1 if a mode is off
+// by more than its bound, or changes the accuracy by more than 0.1%.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string>
+#include <vector>
+
+#include "matrix.hpp"
+#include "nn.hpp"
+#include "dataset.hpp"
+#include "simd.hpp"
+
+static const char* mode_names[] = { "exact", "approx", "saturate" };
+// The error the modes are documented with, and some room.
+static const double max_errors[] = { 1e-6, 5e-6, 5e-6 };
+static const double max_accuracy_delta = 0.001;
+
+static simd::Unary kernel_of(const simd::Kernels& kernels, simd::SigmoidMode mode) {
+    switch (mode) {
+        case simd::SIGMOID_APPROX: return kernels.sigmoid_approx;
+        case simd::SIGMOID_SATURATE: return kernels.sigmoid_saturate;
+        default: return kernels.sigmoid;
+    }
+}
+
+// [-40, 40] every 1/1024, and the far ends.
+static std::vector<matrix_t> sample_inputs() {
+    std::vector<matrix_t> x;
+    for (int i = -40 * 1024; i <= 40 * 1024; i++) x.push_back(i / 1024.f);
+    const matrix_t far[] = { 88.f, 100.f, 1e10f, 3e38f };
+    for (matrix_t v : far) {
+        x.push_back(v);
+        x.push_back(-v);
+    }
+    return x;
+}
+
+static double max_error(const std::vector<matrix_t>& x, const std::vector<matrix_t>& y) {
+    double worst = 0;
+    for (size_t i = 0; i < x.size(); i++) {
+        double expected = 1. / (1. + exp(-(double) x[i]));
+        worst = std::max(worst, fabs(y[i] - expected));
+    }
+    return worst;
+}
+
+static double accuracy(const NN& nn, const DsIdx& dataset) {
+    NN_Workspace ws;
+    NN_Matrix inputs, expected;
+    std::vector<int> indices;
+    int correct = 0;
+    for (int first = 0; first < dataset.count(); first += 256) {
+        int count = std::min(256, dataset.count() - first);
+        indices.resize(count);
+        for (int i = 0; i < count; i++) indices[i] = first + i;
+        dataset.get_batch(indices, inputs, expected);
+        nn.forward(inputs, ws);
+        const NN_Matrix& outputs = ws.outputs.back();
+        for (int r = 0; r < count; r++) {
+            size_t guess = simd::kernels().argmax(outputs.row(r), outputs.cols());
+            size_t label = simd::kernels().argmax(expected.row(r), expected.cols());
+            if (guess == label) correct++;
+        }
+    }
+    return (double) correct / dataset.count();
+}
+
+int main(int argc, char** argv) {
+    std::string dir = (argc > 1) ? argv[1] : "./datasets";
+    bool ok = true;
+
+    std::vector<const simd::Kernels*> tables = { &simd::scalar::table };
+#ifdef NN_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1")) tables.push_back(&simd::sse4::table);
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) tables.push_back(&simd::avx2::table);
+    if (__builtin_cpu_supports("avx512f")) tables.push_back(&simd::avx512::table);
+#endif
+
+    const std::vector<matrix_t> x = sample_inputs();
+    std::vector<matrix_t> y(x.size());
+    for (int m = 0; m < 3; m++) {
+        simd::SigmoidMode mode = (simd::SigmoidMode) m;
+        printf("%-8s  max error:", mode_names[m]);
+        for (const simd::Kernels* kernels : tables) {
+            kernel_of(*kernels, mode)(y.data(), x.data(), x.size());
+            double error = max_error(x, y);
+            printf(" %s %.2e", kernels->name, error);
+            if (error > max_errors[m]) ok = false;
+        }
+        for (size_t i = 0; i < x.size(); i++) y[i] = simd::sigmoid(x[i], mode);
+        double error = max_error(x, y);
+        printf(" | sigmoid() %.2e\n", error);
+        if (error > max_errors[m]) ok = false;
+    }
+
+    std::string train_labels = dir + "/train-labels.idx1-ubyte";
+    std::string train_images = dir + "/train-images.idx3-ubyte";
+    std::string test_labels = dir + "/t10k-labels.idx1-ubyte";
+    std::string test_images = dir + "/t10k-images.idx3-ubyte";
+    std::string error = DsIdx::check(train_labels.c_str(), train_images.c_str());
+    if (error.empty()) error = DsIdx::check(test_labels.c_str(), test_images.c_str());
+    if (!error.empty()) {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+    }
+    DsIdx train(train_labels.c_str(), train_images.c_str());
+    DsIdx test(test_labels.c_str(), test_images.c_str());
+
+    // The trainer's default network, an epoch in order.
+    srand(0);
+    std::vector<std::string> labels;
+    for (int i = 0; i < train.classes; i++) labels.push_back(std::to_string(i));
+    NN nn({ train.input_size(), 20, 10, train.classes }, labels);
+    NN_Matrix input, expected;
+    for (int i = 0; i < train.count(); i++) {
+        train.get_input_into(i, input);
+        train.get_output_into(i, expected);
+        nn.forward(input);
+        nn.backprop(expected);
+    }
+
+    nn.sigmoid_mode = simd::SIGMOID_EXACT;
+    const double exact = accuracy(nn, test);
+    printf("test accuracy: exact %.2f%%", 100 * exact);
+    for (int m = 1; m < 3; m++) {
+        nn.sigmoid_mode = (simd::SigmoidMode) m;
+        double delta = accuracy(nn, test) - exact;
+        printf(" | %s %+.2f%%", mode_names[m], 100 * delta);
+        if (fabs(delta) > max_accuracy_delta) ok = false;
+    }
+    printf("\n");
+
+    printf(ok ? "ok\n" : "FAILED\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,158 @@
+// Checks the snapshots the GUI draws from (see worker.hpp):
+// - a TripleBuffer hammered by a writer and a reader never hands the reader
+//   a half written value, nor an older one than it had;
+// - every snapshot a TrainingWorker publishes is the network exactly as it
+//   was after some sample, the same weights as training serially up to it,
+//   and the worker ends with the serial weights.
+//
+//   g++ -O2 -std=c++17 -pthread check_snapshot.cpp -o check_snapshot
+//   ./check_snapshot [DIR]
+//
+// DIR has the MNIST idx files (./datasets). Exits with 1 on a torn, stale or
+// wrong snapshot.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <atomic>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "nn.hpp"
+#include "dataset.hpp"
+#include "triple_buffer.hpp"
+#include "worker.hpp"
+
+// Every value is the number of the publish.
+struct Stamp {
+    long values[512] = {};
+};
+
+static bool check_triple_buffer(long publishes) {
+    TripleBuffer<Stamp> buffer;
+    std::atomic<bool> done{ false };
+    std::thread writer([&] {
+        for (long n = 1; n <= publishes; n++) {
+            Stamp& s = buffer.write_buffer();
+            for (long& v : s.values) v = n;
+            buffer.publish();
+            // Or on one core the reader hardly gets a turn.
+            if (n % 64 == 0) std::this_thread::yield();
+        }
+        done = true;
+    });
+
+    long torn = 0, stale = 0, seen = 0, last = 0;
+    for (;;) {
+        // Read before update(), so the last publish is seen.
+        bool finished = done;
+        if (!buffer.update()) {
+            if (finished) break;
+            std::this_thread::yield();
+            continue;
+        }
+        const Stamp& s = buffer.read();
+        long n = s.values[0];
+        for (long v : s.values) {
+            if (v != n) {
+                torn++;
+                break;
+            }
+        }
+        if (n < last) stale++;
+        last = n;
+        seen++;
+    }
+    writer.join();
+
+    printf("triple buffer: %ld publishes, %ld read, %ld torn, %ld stale\n", publishes, seen, torn, stale);
+    return torn == 0 && stale == 0;
+}
+
+// FNV-1a of the biases and the weights, without the padding.
+static uint64_t weights_hash(const NN& nn) {
+    uint64_t hash = 14695981039346656037ull;
+    auto add = [&](const NN_Matrix& m) {
+        for (int r = 0; r < m.rows(); r++) {
+            const uint8_t* bytes = (const uint8_t*) m.row(r);
+            for (size_t i = 0; i < m.cols() * sizeof(matrix_t); i++) hash = (hash ^ bytes[i]) * 1099511628211ull;
+        }
+    };
+    for (const Layer& layer : nn.layers) {
+        add(layer.biased);
+        add(layer.weights);
+    }
+    return hash;
+}
+
+static NN make_nn(const DsIdx& dataset) {
+    srand(0);
+    std::vector<std::string> labels;
+    for (int i = 0; i < dataset.classes; i++) labels.push_back(std::to_string(i));
+    return NN({ dataset.input_size(), 20, 10, dataset.classes }, labels);
+}
+
+static bool check_worker(const DsIdx& dataset, int samples) {
+    NN nn = make_nn(dataset);
+    // Every snapshot read, by the sample it was taken after.
+    std::map<int, uint64_t> snapshots;
+    long stale = 0;
+    int last = -1;
+    {
+        TrainingWorker worker(nn, dataset, 1);
+        worker.publish_interval = std::chrono::milliseconds(0);
+        worker.resume(samples);
+        bool running = true;
+        while (running) {
+            running = worker.running();
+            if (!worker.snapshots.update()) {
+                std::this_thread::yield();
+                continue;
+            }
+            const NN& snapshot = worker.snapshots.read().nn;
+            if (snapshot.data_index < last) stale++;
+            last = snapshot.data_index;
+            snapshots[snapshot.data_index] = weights_hash(snapshot);
+        }
+        worker.pause();
+    }
+
+    // The same samples, serially.
+    NN serial = make_nn(dataset);
+    NN_Matrix input, expected;
+    long wrong = 0;
+    for (int i = 0; i <= samples; i++) {
+        auto it = snapshots.find(i);
+        if (it != snapshots.end() && it->second != weights_hash(serial)) wrong++;
+        if (i == samples) break;
+        dataset.get_input_into(i, input);
+        dataset.get_output_into(i, expected);
+        serial.forward(input);
+        serial.backprop(expected);
+    }
+    bool same = weights_hash(nn) == weights_hash(serial);
+
+    printf("worker: %d samples, %zu snapshots, %ld stale, %ld not a serial state, final weights %s\n",
+        samples, snapshots.size(), stale, wrong, same ? "the same" : "DIFFERENT");
+    return stale == 0 && wrong == 0 && same && !snapshots.empty();
+}
+
+int main(int argc, char** argv) {
+    std::string dir = (argc > 1) ? argv[1] : "./datasets";
+    std::string labels = dir + "/train-labels.idx1-ubyte";
+    std::string images = dir + "/train-images.idx3-ubyte";
+    std::string error = DsIdx::check(labels.c_str(), images.c_str());
+    if (!error.empty()) {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+    }
+    DsIdx dataset(labels.c_str(), images.c_str());
+
+    bool ok = check_triple_buffer(200000);
+    if (!check_worker(dataset, std::min(dataset.count(), 20000))) ok = false;
+
+    printf(ok ? "ok\n" : "FAILED\n");
+    return ok ? 0 : 1;
+}
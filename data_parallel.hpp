@@ -0,0 +1,126 @@
+#pragma once
+
+#ifndef DATA_PARALLEL_HPP_INCLUDED
+#define DATA_PARALLEL_HPP_INCLUDED
+
+#include <algorithm>
+#include <vector>
+
+#include "nn.hpp"
+#include "dataset.hpp"
+#include "parallel.hpp"
+
+// Synchronous data parallel SGD, the deterministic counterpart of Hogwild:
+// every batch is split in `replicas` contiguous slices, each runs forward and
+// computes its gradients into its own NN_Workspace, the gradients are summed
+// by a tree all-reduce and applied to the weights in one step.
+//
+// The slices run on the parallel::Pool, but which rows a replica gets and
+// the order the gradients are summed in only depend on the replica count, so
+// the weights come out bit for bit the same for a given count, whatever the
+// number of threads doing the work.
+//
+// Replica r is always computed, and summed into, by thread r % size() of
+// the pool (see Pool::run_each()), so its activations and gradients are
+// touched by that thread first and stay on its NUMA node with NN_NUMA.
+class DataParallel {
+public:
+  DataParallel(NN& nn, int replicas);
+
+  int replicas() const;
+
+  // Mean squared error of the epoch, order is the samples in the order they
+  // are batched.
+  float train_epoch(const Dataset& dataset, const std::vector<int>& order, int batch);
+
+  // One gradient step over the rows of indices, returns the summed cost.
+  double train_batch(const Dataset& dataset, const int* indices, int count);
+
+private:
+  struct Replica {
+    NN_Workspace ws;
+    NN_Matrix inputs;
+    NN_Matrix expected;
+    std::vector<int> indices;
+    double cost = 0;
+  };
+
+  void _compute(int replica);
+  void _reduce(int dst, int src);
+
+  NN& nn;
+  std::vector<Replica> slices;
+
+  // The batch of the current step.
+  const Dataset* dataset = nullptr;
+  const int* indices = nullptr;
+  int count = 0;
+  int active = 0; // Replicas with at least a row.
+};
+
+DataParallel::DataParallel(NN& nn, int replicas) : nn(nn), slices(replicas > 0 ? replicas : 1) {}
+
+int DataParallel::replicas() const {
+  return (int) slices.size();
+}
+
+// Rows [count * r / active, count * (r + 1) / active) of the batch.
+void DataParallel::_compute(int r) {
+  Replica& replica = slices[r];
+  int first = (int)((long long) count * r / active);
+  int last = (int)((long long) count * (r + 1) / active);
+  replica.indices.assign(indices + first, indices + last);
+
+  dataset->get_batch(replica.indices, replica.inputs, replica.expected);
+  nn.forward(replica.inputs, replica.ws);
+  replica.cost = (replica.ws.outputs.back() - replica.expected).square().sum() / replica.expected.cols();
+  nn.compute_gradients(replica.expected, replica.ws);
+}
+
+// slices[dst] += slices[src], gradients and cost.
+void DataParallel::_reduce(int dst, int src) {
+  NN_Workspace& a = slices[dst].ws;
+  const NN_Workspace& b = slices[src].ws;
+  a.grad_params += b.grad_params;
+  slices[dst].cost += slices[src].cost;
+}
+
+double DataParallel::train_batch(const Dataset& dataset, const int* indices, int count) {
+  if (count <= 0) return 0;
+  this->dataset = &dataset;
+  this->indices = indices;
+  this->count = count;
+  active = std::min(count, replicas());
+
+  parallel::parallel_each([&](int thread, int threads) {
+    for (int r = thread; r < active; r += threads) _compute(r);
+  });
+
+  // Pairs `step` apart are summed into the first of them, doubling the step
+  // each round until everything is in slices[0]. The pairs of a round are
+  // independent of each other.
+  for (int step = 1; step < active; step *= 2) {
+    int pairs = (active - step + 2 * step - 1) / (2 * step);
+    parallel::parallel_each([&](int thread, int threads) {
+      for (int p = 0; p < pairs; p++) {
+        int dst = p * 2 * step;
+        if (dst % threads == thread) _reduce(dst, dst + step);
+      }
+    });
+  }
+
+  nn.apply_gradients(slices[0].ws, -nn.learn_rate / count);
+  return slices[0].cost;
+}
+
+float DataParallel::train_epoch(const Dataset& dataset, const std::vector<int>& order, int batch) {
+  assert(batch >= 1);
+  double cost = 0;
+  for (int first = 0; first < (int) order.size(); first += batch) {
+    int count = std::min(batch, (int) order.size() - first);
+    cost += train_batch(dataset, order.data() + first, count);
+  }
+  return order.empty() ? 0.f : (float)(cost / order.size());
+}
+
+#endif // DATA_PARALLEL_HPP_INCLUDED
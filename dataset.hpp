@@ -0,0 +1,506 @@
+#pragma once
+
+#ifndef DATASET_HPP_INCLUDED
+#define DATASET_HPP_INCLUDED
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(_WIN32)
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "debug.hpp"
+#include "mapped_file.hpp"
+#include "matrix.hpp"
+#include "numa.hpp"
+
+class Dataset {
+public:
+    virtual ~Dataset() {}
+
+    virtual int count() const = 0;
+    virtual NN_Matrix get_input(int index) const = 0;
+    virtual NN_Matrix get_output(int index) const = 0;
+
+    // Write the sample into dst, reusing its storage. Override these to
+    // avoid the copy (and the allocation) of the default ones.
+    virtual void get_input_into(int index, NN_Matrix& dst) const { dst = get_input(index); }
+    virtual void get_output_into(int index, NN_Matrix& dst) const { dst = get_output(index); }
+
+    // The samples at indices as the rows of out_inputs and out_labels (the
+    // expected outputs), reusing their storage. Safe to call from several
+    // threads at once, as long as the *_into() ones are.
+    virtual void get_batch(const std::vector<int>& indices, NN_Matrix& out_inputs, NN_Matrix& out_labels) const;
+
+    // The samples [shard_begin(s, shards), shard_begin(s + 1, shards)) are
+    // shard s of shards contiguous ones.
+    int shard_begin(int shard, int shards) const { return (int)((long long) count() * shard / shards); }
+};
+
+// Goes through get_input_into() / get_output_into() one sample at a time.
+void Dataset::get_batch(const std::vector<int>& indices, NN_Matrix& out_inputs, NN_Matrix& out_labels) const {
+    static thread_local NN_Matrix _sample;
+    int batch = (int) indices.size();
+    for (int i = 0; i < batch; i++) {
+        get_input_into(indices[i], _sample);
+        if (i == 0 && (out_inputs.rows() != batch || out_inputs.cols() != _sample.cols())) {
+            out_inputs.init(batch, _sample.cols());
+        }
+        memcpy(out_inputs.row(i), _sample.row(0), _sample.cols() * sizeof(matrix_t));
+
+        get_output_into(indices[i], _sample);
+        if (i == 0 && (out_labels.rows() != batch || out_labels.cols() != _sample.cols())) {
+            out_labels.init(batch, _sample.cols());
+        }
+        memcpy(out_labels.row(i), _sample.row(0), _sample.cols() * sizeof(matrix_t));
+    }
+}
+
+
+// A range of the bytes of a MappedFile, without a copy.
+class DsBytes {
+public:
+    DsBytes() {}
+    DsBytes(const uint8_t* data, size_t size) : _data(data), _size(size) {}
+
+    const uint8_t* data() const { return _data; }
+    size_t size() const { return _size; }
+    uint8_t operator[](size_t i) const { return _data[i]; }
+    const uint8_t* begin() const { return _data; }
+    const uint8_t* end() const { return _data + _size; }
+
+private:
+    const uint8_t* _data = nullptr;
+    size_t _size = 0;
+};
+
+
+// Consecutive samples of a DsIdx, on its buffers: no copy.
+struct DsIdxView {
+    const uint8_t* pixels; // count images of rows * cols, one after the other.
+    const uint8_t* labels;
+    int count;
+    int rows;
+    int cols;
+
+    const uint8_t* image(int i) const { return pixels + (size_t)i * rows * cols; }
+};
+
+
+// Images and labels in the IDX format of MNIST (an idx3 file of u8 images
+// and an idx1 file of u8 labels). The inputs are the pixels scaled to
+// [0, 1], the outputs one-hot rows of `classes` values.
+//
+// The files are mapped (see MappedFile) and the samples read straight from
+// them: opening a dataset maps the files and goes over the labels only, and
+// the trainer processes of a box share the pages of the images.
+class DsIdx : public Dataset {
+public:
+    DsIdx(const char* path_labels, const char* path_images);
+    ~DsIdx();
+
+    // On the mapped files (the images on the copy of place_shards() once
+    // it's called), the images one after the other.
+    DsBytes labels;
+    DsBytes pixels; // count() images of image_rows * image_cols.
+    int image_rows = 0;
+    int image_cols = 0;
+    int classes = 0;
+
+    int count() const override;
+    int input_size() const;
+
+    NN_Matrix get_input(int index) const override;
+    NN_Matrix get_output(int index) const override;
+
+    void get_input_into(int index, NN_Matrix& dst) const override;
+    void get_output_into(int index, NN_Matrix& dst) const override;
+    void get_batch(const std::vector<int>& indices, NN_Matrix& out_inputs, NN_Matrix& out_labels) const override;
+
+    const uint8_t* image(int index) const;
+    // The samples [first, first + count).
+    DsIdxView view(int first, int count = 1) const;
+
+    // How the images are about to be read, in order or shuffled.
+    void advise(bool sequential) const;
+
+    // Reads the inputs from the cache file at path from now on, the pixels
+    // already scaled to floats (see DsCacheHeader), mapped. It's written
+    // first if it's missing or not of these images. False if it can't be,
+    // or on a big endian machine, the pixels are read as before then.
+    bool use_cache(const char* path);
+    // The bytes the inputs are read from, the pixels or the cached floats.
+    DsBytes input_bytes() const;
+
+    // Copies the inputs (the pixels or the cached floats) out of the mapped
+    // file, shard n of `nodes` (see shard_begin()) on NUMA node n, for the
+    // threads of that node (see parallel::Pool::node()), and reads them from
+    // there from now on. The pages of a mapped file are the page cache's,
+    // shared by every process, which no memory policy moves, so the copy is
+    // the process's own: each shard bound to its node and first touched by
+    // a thread of it. False if the pages couldn't be bound, the copy is made
+    // and used anyway.
+    bool place_shards(int nodes);
+
+    // Whether the file can be opened, to report a missing dataset before
+    // the asserts of the constructor do.
+    static bool readable(const char* path);
+    // Empty if the files are a valid pair of IDX labels and images, what's
+    // wrong otherwise, to report it before the asserts of the constructor.
+    static std::string check(const char* path_labels, const char* path_images);
+
+private:
+    void _pixels_to_row(int index, matrix_t* dst) const;
+
+    bool _map_cache(const char* path, const struct DsCacheHeader& expected);
+
+    MappedFile _labels_file;
+    MappedFile _images_file;
+    MappedFile _cache_file;
+    const matrix_t* _inputs = nullptr; // In _cache_file, when there's one.
+    uint8_t* _local = nullptr;         // The copy of place_shards().
+};
+
+// The cache file of DsIdx::use_cache(): this header in 64 bytes, then the
+// inputs of every sample one after the other, as float32. All of it is
+// little endian, the floats are read in place, so a big endian machine
+// doesn't use a cache. A value is pixel / divisor.
+//
+// It's of the images file if its shape, size and sampled pages (see
+// _ds_sample_hash()) match, and its modification time. A copied file has
+// another time, then its contents are hashed and checked against the hash.
+struct DsCacheHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t count;
+  uint32_t rows;
+  uint32_t cols;
+  float divisor;
+  uint64_t source_size;
+  int64_t source_mtime;
+  uint64_t source_hash;
+  uint64_t source_sample;
+  uint8_t padding[8];
+};
+static_assert(sizeof(DsCacheHeader) == 64, "The cache header isn't 64 bytes.");
+static_assert(sizeof(matrix_t) == 4, "The cache is of float32.");
+
+#define NN_CACHE_MAGIC 0x3143544E // "NTC1"
+
+// The header values are big endian.
+static inline uint32_t _idx_read_u32(const uint8_t*& ptr) {
+  uint32_t value = ((uint32_t)ptr[0] << 24) | ((uint32_t)ptr[1] << 16) | ((uint32_t)ptr[2] << 8) | ptr[3];
+  ptr += 4;
+  return value;
+}
+
+// Null if the file is an IDX file of u8 values with the magic number (2049
+// for the labels, 2051 for the images, the low byte is the dimensions) and
+// the values its sizes say, what's wrong otherwise. sizes gets the sizes and
+// values where the values start.
+static const char* _idx_header(const MappedFile& file, uint32_t magic, uint32_t* sizes, const uint8_t*& values) {
+  const size_t dims = magic & 0xff;
+  const size_t header = 4 + 4 * dims;
+  if (file.size() < header) return "too short for an IDX header";
+
+  const uint8_t* ptr = file.data();
+  if (_idx_read_u32(ptr) != magic) return "not the expected IDX magic number";
+
+  size_t count = 1;
+  for (size_t i = 0; i < dims; i++) {
+    sizes[i] = _idx_read_u32(ptr);
+    if (sizes[i] != 0 && count > (file.size() - header) / sizes[i]) return "shorter than its header says";
+    count *= sizes[i];
+  }
+  if (file.size() - header < count) return "shorter than its header says";
+  values = ptr;
+  return nullptr;
+}
+
+bool DsIdx::readable(const char* path) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) return false;
+  fclose(file);
+  return true;
+}
+
+std::string DsIdx::check(const char* path_labels, const char* path_images) {
+  MappedFile labels_file, images_file;
+  if (!labels_file.open(path_labels)) return std::string("Cannot open ") + path_labels;
+  if (!images_file.open(path_images)) return std::string("Cannot open ") + path_images;
+
+  uint32_t labels_size, images_sizes[3];
+  const uint8_t* values;
+  if (const char* error = _idx_header(labels_file, 2049, &labels_size, values)) return std::string(path_labels) + ": " + error;
+  if (const char* error = _idx_header(images_file, 2051, images_sizes, values)) return std::string(path_images) + ": " + error;
+  if (labels_size != images_sizes[0]) return std::string(path_labels) + ": not as many labels as images";
+  return std::string();
+}
+
+DsIdx::~DsIdx() {
+  nn_aligned_free(_local);
+}
+
+DsIdx::DsIdx(const char* path_labels, const char* path_images) {
+  bool opened = _labels_file.open(path_labels) && _images_file.open(path_images);
+  assert(opened && "Cannot open the dataset file.");
+  (void) opened;
+
+  // The labels.
+  {
+    uint32_t size;
+    const uint8_t* values;
+    const char* error = _idx_header(_labels_file, 2049, &size, values);
+    assert(error == nullptr);
+    (void) error;
+    labels = DsBytes(values, size);
+
+    // They're gone over right away.
+    _labels_file.advise(0, _labels_file.size(), MappedFile::WILLNEED);
+    for (uint8_t label : labels) {
+      if (label + 1 > classes) classes = label + 1;
+    }
+  }
+
+  // The images.
+  {
+    uint32_t sizes[3];
+    const uint8_t* values;
+    const char* error = _idx_header(_images_file, 2051, sizes, values);
+    assert(error == nullptr);
+    (void) error;
+    assert(sizes[0] == labels.size());
+    image_rows = (int) sizes[1];
+    image_cols = (int) sizes[2];
+    pixels = DsBytes(values, (size_t)sizes[0] * image_rows * image_cols);
+  }
+}
+
+// FNV-1a over 8 bytes at a time, the tail byte by byte.
+static inline uint64_t _ds_hash(const uint8_t* data, size_t size) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    memcpy(&word, data + i, 8);
+    hash = (hash ^ word) * 0x100000001b3ULL;
+  }
+  for (; i < size; i++) hash = (hash ^ data[i]) * 0x100000001b3ULL;
+  return hash;
+}
+
+// The hash of the first page, with the IDX header, and of a page at every
+// eighth of the file up to the last one, 36 KB read on every open. The
+// time alone misses a file rewritten within its second or with the time
+// set back.
+static inline uint64_t _ds_sample_hash(const uint8_t* data, size_t size) {
+  const size_t page = std::min<size_t>(size, 4096);
+  uint64_t hash = _ds_hash(data, page);
+  for (size_t i = 1; i <= 8; i++) {
+    hash = (hash ^ _ds_hash(data + (size - page) / 8 * i, page)) * 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static inline bool _ds_little_endian() {
+  const uint32_t one = 1;
+  uint8_t first;
+  memcpy(&first, &one, 1);
+  return first == 1;
+}
+
+bool DsIdx::_map_cache(const char* path, const DsCacheHeader& expected) {
+  if (!_cache_file.open(path)) return false;
+  const size_t bytes = (size_t) count() * input_size() * sizeof(matrix_t);
+  if (_cache_file.size() != sizeof(DsCacheHeader) + bytes) return false;
+
+  DsCacheHeader header;
+  memcpy(&header, _cache_file.data(), sizeof header);
+  if (header.magic != expected.magic || header.version != expected.version ||
+      header.count != expected.count || header.rows != expected.rows || header.cols != expected.cols ||
+      header.divisor != expected.divisor || header.source_size != expected.source_size ||
+      header.source_sample != expected.source_sample) return false;
+  if (header.source_mtime != expected.source_mtime) {
+    if (header.source_hash != _ds_hash(_images_file.data(), _images_file.size())) return false;
+    // The same images with another time, it matches the next time.
+    FILE* file = fopen(path, "r+b");
+    if (file != NULL) {
+      fseek(file, offsetof(DsCacheHeader, source_mtime), SEEK_SET);
+      fwrite(&expected.source_mtime, sizeof expected.source_mtime, 1, file);
+      fclose(file);
+    }
+  }
+
+  _inputs = (const matrix_t*)(_cache_file.data() + sizeof header);
+  return true;
+}
+
+bool DsIdx::use_cache(const char* path) {
+  _inputs = nullptr;
+  if (!_ds_little_endian()) return false;
+  DsCacheHeader header;
+  memset(&header, 0, sizeof header);
+  header.magic = NN_CACHE_MAGIC;
+  header.version = 2;
+  header.count = (uint32_t) count();
+  header.rows = (uint32_t) image_rows;
+  header.cols = (uint32_t) image_cols;
+  header.divisor = 255.f;
+  header.source_size = _images_file.size();
+  header.source_mtime = _images_file.mtime();
+  header.source_sample = _ds_sample_hash(_images_file.data(), _images_file.size());
+  if (_map_cache(path, header)) return true;
+  _cache_file.close();
+
+  // Into another file renamed over it once complete, a process which maps
+  // it meanwhile gets the whole old one or the whole new one. The file is
+  // the process's own, several trainers on the host can write it at once
+  // and the last rename wins.
+  header.source_hash = _ds_hash(_images_file.data(), _images_file.size());
+#if defined(_WIN32)
+  std::string temp = std::string(path) + "." + std::to_string(_getpid()) + ".tmp";
+#else
+  std::string temp = std::string(path) + "." + std::to_string(getpid()) + ".tmp";
+#endif
+  FILE* file = fopen(temp.c_str(), "wb");
+  if (file == NULL) return false;
+  bool ok = fwrite(&header, sizeof header, 1, file) == 1;
+  std::vector<matrix_t> row(input_size());
+  for (int i = 0; ok && i < count(); i++) {
+    _pixels_to_row(i, row.data());
+    ok = fwrite(row.data(), sizeof(matrix_t), row.size(), file) == row.size();
+  }
+  ok = (fclose(file) == 0) && ok;
+#if defined(_WIN32)
+  remove(path); // rename() doesn't replace there.
+#endif
+  if (!ok || rename(temp.c_str(), path) != 0) {
+    remove(temp.c_str());
+    return false;
+  }
+
+  if (_map_cache(path, header)) return true;
+  _cache_file.close();
+  return false;
+}
+
+DsBytes DsIdx::input_bytes() const {
+  if (_inputs == nullptr) return pixels;
+  return DsBytes((const uint8_t*) _inputs, (size_t) count() * input_size() * sizeof(matrix_t));
+}
+
+void DsIdx::advise(bool sequential) const {
+  // A copy isn't read ahead.
+  if (_local != nullptr) return;
+  const MappedFile& file = (_inputs != nullptr) ? _cache_file : _images_file;
+  const DsBytes inputs = input_bytes();
+  file.advise(inputs.data() - file.data(), inputs.size(), sequential ? MappedFile::SEQUENTIAL : MappedFile::RANDOM);
+}
+
+bool DsIdx::place_shards(int nodes) {
+  assert(nodes == parallel::Pool::instance().nodes());
+  (void) nodes;
+  const DsBytes inputs = input_bytes();
+  uint8_t* local = (uint8_t*) nn_aligned_alloc(std::max<size_t>(1, inputs.size()));
+  assert(local != nullptr && "Cannot allocate the copy of the inputs.");
+
+  // The first thread of every node copies its shard.
+  const size_t sample = inputs.size() / std::max(1, count());
+  parallel::Pool& pool = parallel::Pool::instance();
+  std::atomic<bool> ok{ true };
+  parallel::parallel_each([&](int thread, int) {
+    const int n = pool.node(thread);
+    if (thread > 0 && pool.node(thread - 1) == n) return;
+    const size_t first = (size_t) shard_begin(n, nodes) * sample;
+    const size_t last = (size_t) shard_begin(n + 1, nodes) * sample;
+    if (!numa::bind(local + first, last - first, n)) ok = false;
+    memcpy(local + first, inputs.data() + first, last - first);
+  });
+
+  if (_inputs != nullptr) _inputs = (const matrix_t*) local;
+  else pixels = DsBytes(local, inputs.size());
+  nn_aligned_free(_local);
+  _local = local;
+  return ok;
+}
+
+int DsIdx::count() const {
+  return (int) labels.size();
+}
+
+int DsIdx::input_size() const {
+  return image_rows * image_cols;
+}
+
+const uint8_t* DsIdx::image(int index) const {
+  return pixels.data() + (size_t)index * input_size();
+}
+
+DsIdxView DsIdx::view(int first, int count) const {
+  assert(first >= 0 && count >= 0 && first + count <= this->count());
+  return DsIdxView{ image(first), labels.data() + first, count, image_rows, image_cols };
+}
+
+void DsIdx::_pixels_to_row(int index, matrix_t* dst) const {
+  if (_inputs != nullptr) {
+    memcpy(dst, _inputs + (size_t) index * input_size(), input_size() * sizeof(matrix_t));
+    return;
+  }
+  const uint8_t* src = image(index);
+  for (int i = 0; i < input_size(); i++) {
+    dst[i] = (matrix_t) src[i] / 255.f;
+  }
+}
+
+NN_Matrix DsIdx::get_input(int index) const {
+  NN_Matrix input;
+  get_input_into(index, input);
+  return input;
+}
+
+NN_Matrix DsIdx::get_output(int index) const {
+  NN_Matrix output;
+  get_output_into(index, output);
+  return output;
+}
+
+void DsIdx::get_input_into(int index, NN_Matrix& dst) const {
+  if (dst.rows() != 1 || dst.cols() != input_size()) {
+    dst.init(1, input_size());
+  }
+  _pixels_to_row(index, dst.row(0));
+}
+
+void DsIdx::get_output_into(int index, NN_Matrix& dst) const {
+  dst.init(1, classes);
+  dst.set(0, labels[index], 1.f);
+}
+
+// The pixels go straight into the rows, without a matrix per sample. A large
+// batch is converted by the parallel::Pool, rows apart.
+void DsIdx::get_batch(const std::vector<int>& indices, NN_Matrix& out_inputs, NN_Matrix& out_labels) const {
+  int batch = (int) indices.size();
+  if (out_inputs.rows() != batch || out_inputs.cols() != input_size()) {
+    out_inputs.init(batch, input_size());
+  }
+  out_labels.init(batch, classes);
+
+  auto rows = [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      _pixels_to_row(indices[i], out_inputs.row(i));
+      out_labels.set(i, labels[indices[i]], 1.f);
+    }
+  };
+  if ((size_t) batch * input_size() < NN_EXPR_PARALLEL) rows(0, batch);
+  else parallel::parallel_for(0, batch, std::max(1, NN_EXPR_GRAIN / input_size()), rows);
+}
+
+#endif // DATASET_HPP_INCLUDED
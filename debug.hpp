@@ -0,0 +1,22 @@
+#pragma once
+
+#ifndef DEBUG_HPP_INCLUDED
+#define DEBUG_HPP_INCLUDED
+
+// The asserts stay in every build and stop in the debugger. __debugbreak()
+// only exists with MSVC / MinGW, elsewhere SIGTRAP does the same (and kills
+// the process with a core dump when there is no debugger attached).
+#if defined(_WIN32)
+  #include <intrin.h>
+  #define NN_DEBUGBREAK() __debugbreak()
+#else
+  #include <signal.h>
+  #define NN_DEBUGBREAK() raise(SIGTRAP)
+#endif
+
+#define assert(cond)               \
+  do {                             \
+    if (!(cond)) NN_DEBUGBREAK();  \
+  } while (false)
+
+#endif // DEBUG_HPP_INCLUDED
@@ -0,0 +1,513 @@
+#pragma once
+
+#ifndef GEMM_HPP_INCLUDED
+#define GEMM_HPP_INCLUDED
+
+#include <string.h>
+
+typedef float matrix_t;
+
+#include "storage.hpp"
+#include "parallel.hpp"
+
+// Cache blocked matrix multiplication (Goto / BLIS style). All matrices are
+// row major with a leading dimension (distance between two rows in elements).
+//
+//   C (M x N) = alpha * op(A) (M x K) * op(B) (K x N) + beta * C
+//
+// where op(X) is X or its transpose, like the BLAS transA / transB flags.
+// A transposed operand is read in place, the transpose only changes the
+// order the packing routines walk it.
+//
+// The loops are blocked so that a (KC x NC) panel of B stays in L2/L3 and a
+// (MC x KC) block of A stays in L2. Both are packed into contiguous slivers
+// which the micro kernel streams through while it keeps a (MR x NR) tile of
+// C in registers.
+
+#define NN_GEMM_MR 6
+#define NN_GEMM_NR 8
+
+#define NN_GEMM_MC 128
+#define NN_GEMM_KC 256
+#define NN_GEMM_NC 2048
+
+// Below this many multiply-adds packing costs more than it saves.
+#define NN_GEMM_SMALL (32 * 32 * 32)
+
+// A gemv (single row of A) finishes its outputs NN_GEMV_NB at a time, and is
+// split between the threads above NN_GEMV_PARALLEL multiply-adds (about 1MB
+// of B, below that waking the threads costs more).
+#define NN_GEMV_NB 32
+#define NN_GEMV_PARALLEL (256 * 1024)
+
+// Above this many multiply-adds a gemm is split by the columns of C between
+// the threads. The shards are whole NN_SHARD_FLOATS (a 4KB page) wide when
+// C is wide enough, so a page of a row belongs to a single shard.
+#define NN_GEMM_PARALLEL (1024 * 1024)
+#define NN_SHARD_FLOATS 1024
+
+namespace gemm {
+
+// What to do with the result while it is still hot, applied once per element
+// after the last k block: c = activation(c + bias), bias being a row vector
+// (of n values) added to every row. Either part may be null.
+typedef void (*Activation)(matrix_t* dst, const matrix_t* src, size_t n);
+
+struct Epilogue {
+  const matrix_t* bias = nullptr;
+  Activation activation = nullptr;
+};
+
+// Columns [j0, j1) of n in shard `shard` of `shards`. Every call with the
+// same arguments gives the same columns, and with Pool::run_each() the same
+// shard goes to the same thread, so a shard of a matrix is always written
+// (first touched, then updated) by the same thread.
+static inline void shard_cols(int n, int shard, int shards, int& j0, int& j1) {
+  int unit = (n >= shards * NN_SHARD_FLOATS) ? NN_SHARD_FLOATS : NN_GEMV_NB;
+  int units = (n + unit - 1) / unit;
+  j0 = (int)((long long) units * shard / shards) * unit;
+  j1 = (int)((long long) units * (shard + 1) / shards) * unit;
+  if (j0 > n) j0 = n;
+  if (j1 > n) j1 = n;
+}
+
+// Scratch buffers for the packed panels, kept around between the calls so
+// the steady state doesn't allocate.
+static inline matrix_t* _pack_buffer(NN_Storage& buff, size_t size) {
+  if (buff.size() < size) buff.resize(size);
+  return buff.data();
+}
+
+// Pack a (mc x kc) block of op(A) into slivers of MR rows, each stored
+// column by column so the kernel reads MR consecutive values per k. The last
+// sliver is padded with zeros. a points at op(A)[0][0].
+static void _pack_a(bool trans, int mc, int kc, const matrix_t* a, int lda, matrix_t* dst) {
+  for (int i = 0; i < mc; i += NN_GEMM_MR) {
+    int mr = (mc - i < NN_GEMM_MR) ? mc - i : NN_GEMM_MR;
+    for (int p = 0; p < kc; p++) {
+      if (trans) {
+        const matrix_t* row = a + p * lda + i;
+        for (int r = 0; r < mr; r++) *dst++ = row[r];
+      } else {
+        for (int r = 0; r < mr; r++) *dst++ = a[(i + r) * lda + p];
+      }
+      for (int r = mr; r < NN_GEMM_MR; r++) *dst++ = 0;
+    }
+  }
+}
+
+// Pack a (kc x nc) panel of op(B) into slivers of NR columns, each stored
+// row by row. The last sliver is padded with zeros. b points at op(B)[0][0].
+static void _pack_b(bool trans, int kc, int nc, const matrix_t* b, int ldb, matrix_t* dst) {
+  for (int j = 0; j < nc; j += NN_GEMM_NR) {
+    int nr = (nc - j < NN_GEMM_NR) ? nc - j : NN_GEMM_NR;
+    for (int p = 0; p < kc; p++) {
+      if (trans) {
+        for (int c = 0; c < nr; c++) *dst++ = b[(j + c) * ldb + p];
+      } else {
+        const matrix_t* row = b + p * ldb + j;
+        for (int c = 0; c < nr; c++) *dst++ = row[c];
+      }
+      for (int c = nr; c < NN_GEMM_NR; c++) *dst++ = 0;
+    }
+  }
+}
+
+// 4 wide float vector (SSE on x86, NEON on ARM) through the GCC/Clang vector
+// extension, so the register tile is explicit rather than left to the
+// auto vectorizer.
+typedef matrix_t v4f __attribute__((vector_size(16)));
+
+static inline v4f _load(const matrix_t* p) {
+  v4f v; memcpy(&v, p, sizeof v); return v;
+}
+
+static inline void _store(matrix_t* p, v4f v) {
+  memcpy(p, &v, sizeof v);
+}
+
+// Computes a (MR x NR) tile: c = alpha * a * b + beta * c, where only the
+// top left (mr x nr) part of the tile is written back and c isn't read at all
+// when beta is zero. The whole tile lives in MR * NR / 4 vector registers for
+// the duration of the k loop. If ep is given (last k block only) its bias,
+// starting at this tile's first column, and activation are applied before
+// anything is stored.
+static void _kernel(
+    int kc, const matrix_t* __restrict a, const matrix_t* __restrict b,
+    matrix_t* c, int ldc, int mr, int nr, matrix_t alpha, matrix_t beta,
+    const Epilogue* ep) {
+
+  v4f acc[NN_GEMM_MR][NN_GEMM_NR / 4];
+  for (int r = 0; r < NN_GEMM_MR; r++)
+    for (int j = 0; j < NN_GEMM_NR / 4; j++)
+      acc[r][j] = v4f{ 0, 0, 0, 0 };
+
+  for (int p = 0; p < kc; p++) {
+    v4f bv[NN_GEMM_NR / 4];
+    #pragma GCC unroll 8
+    for (int j = 0; j < NN_GEMM_NR / 4; j++) bv[j] = _load(b + 4 * j);
+
+    #pragma GCC unroll 16
+    for (int r = 0; r < NN_GEMM_MR; r++) {
+      const v4f ar = v4f{ a[r], a[r], a[r], a[r] };
+      #pragma GCC unroll 8
+      for (int j = 0; j < NN_GEMM_NR / 4; j++) {
+        acc[r][j] += ar * bv[j];
+      }
+    }
+    a += NN_GEMM_MR;
+    b += NN_GEMM_NR;
+  }
+
+  // Full tile, write the vectors straight back.
+  if (mr == NN_GEMM_MR && nr == NN_GEMM_NR && ep == nullptr) {
+    const v4f va = v4f{ alpha, alpha, alpha, alpha };
+    const v4f vb = v4f{ beta, beta, beta, beta };
+    for (int r = 0; r < NN_GEMM_MR; r++) {
+      matrix_t* row = c + r * ldc;
+      for (int j = 0; j < NN_GEMM_NR / 4; j++) {
+        v4f v = va * acc[r][j];
+        if (beta != 0) v += vb * _load(row + 4 * j);
+        _store(row + 4 * j, v);
+      }
+    }
+    return;
+  }
+
+  // Edge tile or an epilogue, go through a temporary.
+  matrix_t tile[NN_GEMM_MR][NN_GEMM_NR];
+  memcpy(tile, acc, sizeof tile);
+  for (int r = 0; r < mr; r++) {
+    const matrix_t* row = c + r * ldc;
+    if (beta != 0) {
+      for (int j = 0; j < nr; j++) tile[r][j] = alpha * tile[r][j] + beta * row[j];
+    } else if (alpha != 1) {
+      for (int j = 0; j < nr; j++) tile[r][j] = alpha * tile[r][j];
+    }
+  }
+
+  if (ep != nullptr) {
+    if (ep->bias != nullptr) {
+      for (int r = 0; r < mr; r++)
+        for (int j = 0; j < nr; j++) tile[r][j] += ep->bias[j];
+    }
+    // The whole tile in one call so even the widest kernels get full vectors.
+    if (ep->activation != nullptr) {
+      ep->activation(&tile[0][0], &tile[0][0], NN_GEMM_MR * NN_GEMM_NR);
+    }
+  }
+
+  for (int r = 0; r < mr; r++) {
+    memcpy(c + r * ldc, tile[r], nr * sizeof(matrix_t));
+  }
+}
+
+// Applies the epilogue to one finished row of c (n values from column j).
+static inline void _epilogue_row(const Epilogue* ep, matrix_t* row, int j, int n) {
+  if (ep == nullptr) return;
+  if (ep->bias != nullptr) {
+    for (int i = 0; i < n; i++) row[i] += ep->bias[j + i];
+  }
+  if (ep->activation != nullptr) ep->activation(row, row, n);
+}
+
+// c = beta * c for a (m x n) block, with beta = 0 clearing it (even if it
+// held NaNs).
+static void _scale_c(int m, int n, matrix_t beta, matrix_t* c, int ldc) {
+  if (beta == 1) return;
+  for (int i = 0; i < m; i++) {
+    matrix_t* row = c + i * ldc;
+    if (beta == 0) memset(row, 0, n * sizeof(matrix_t));
+    else for (int j = 0; j < n; j++) row[j] *= beta;
+  }
+}
+
+// Unpacked loops for the products that are too small to be worth packing
+// (e.g. a single row times the weights). Without transposed B it's an i-k-j
+// loop over the rows of B, with it every output is a dot product of two
+// contiguous rows.
+static void _gemm_small(
+    bool trans_a, bool trans_b,
+    int m, int n, int k, matrix_t alpha,
+    const matrix_t* a, int lda,
+    const matrix_t* b, int ldb,
+    matrix_t beta, matrix_t* c, int ldc,
+    const Epilogue* ep) {
+
+  for (int i = 0; i < m; i++) {
+    matrix_t* row_c = c + i * ldc;
+
+    if (trans_b) {
+      for (int j = 0; j < n; j++) {
+        const matrix_t* row_b = b + j * ldb;
+        matrix_t dot = 0;
+        if (trans_a) {
+          for (int p = 0; p < k; p++) dot += a[p * lda + i] * row_b[p];
+        } else {
+          const matrix_t* row_a = a + i * lda;
+          for (int p = 0; p < k; p++) dot += row_a[p] * row_b[p];
+        }
+        row_c[j] = alpha * dot + ((beta != 0) ? beta * row_c[j] : 0);
+      }
+
+    } else {
+      _scale_c(1, n, beta, row_c, ldc);
+      for (int p = 0; p < k; p++) {
+        const matrix_t aip = alpha * (trans_a ? a[p * lda + i] : a[i * lda + p]);
+        const matrix_t* row_b = b + p * ldb;
+        for (int j = 0; j < n; j++) {
+          row_c[j] += aip * row_b[j];
+        }
+      }
+    }
+
+    // The row was just written, it's still in L1.
+    _epilogue_row(ep, row_c, 0, n);
+  }
+}
+
+// acc[0, n) += x * B for the n columns of B starting at b: the rows of B
+// are streamed 4 at a time, so the accumulators (in L1) are loaded and
+// stored once per 4 rows.
+static void _gemv_rows(
+    int n, int k, const matrix_t* __restrict x,
+    const matrix_t* __restrict b, int ldb, matrix_t* __restrict acc) {
+
+  int p = 0;
+  for (; p + 4 <= k; p += 4) {
+    const matrix_t* b0 = b + (size_t)p * ldb;
+    const matrix_t* b1 = b0 + ldb;
+    const matrix_t* b2 = b1 + ldb;
+    const matrix_t* b3 = b2 + ldb;
+    const v4f x0 = v4f{ x[p], x[p], x[p], x[p] };
+    const v4f x1 = v4f{ x[p + 1], x[p + 1], x[p + 1], x[p + 1] };
+    const v4f x2 = v4f{ x[p + 2], x[p + 2], x[p + 2], x[p + 2] };
+    const v4f x3 = v4f{ x[p + 3], x[p + 3], x[p + 3], x[p + 3] };
+
+    int j = 0;
+    for (; j + 4 <= n; j += 4) {
+      v4f v = _load(acc + j);
+      v += x0 * _load(b0 + j);
+      v += x1 * _load(b1 + j);
+      v += x2 * _load(b2 + j);
+      v += x3 * _load(b3 + j);
+      _store(acc + j, v);
+    }
+    for (; j < n; j++) {
+      acc[j] += x[p] * b0[j] + x[p + 1] * b1[j] + x[p + 2] * b2[j] + x[p + 3] * b3[j];
+    }
+  }
+
+  for (; p < k; p++) {
+    const matrix_t* row = b + (size_t)p * ldb;
+    for (int j = 0; j < n; j++) acc[j] += x[p] * row[j];
+  }
+}
+
+static inline matrix_t _dot(const matrix_t* __restrict x, const matrix_t* __restrict y, int k) {
+  v4f acc0 = v4f{ 0, 0, 0, 0 }, acc1 = acc0;
+  int p = 0;
+  for (; p + 8 <= k; p += 8) {
+    acc0 += _load(x + p) * _load(y + p);
+    acc1 += _load(x + p + 4) * _load(y + p + 4);
+  }
+  acc0 += acc1;
+  matrix_t dot = acc0[0] + acc0[1] + acc0[2] + acc0[3];
+  for (; p < k; p++) dot += x[p] * y[p];
+  return dot;
+}
+
+// Columns [j0, j1) of y = alpha * x * op(B) + beta * y, followed by the
+// epilogue on the same columns.
+static void _gemv_range(
+    bool trans_b, int j0, int j1, int k, matrix_t alpha,
+    const matrix_t* x, const matrix_t* b, int ldb,
+    matrix_t beta, matrix_t* y, const Epilogue* ep) {
+
+  // Every thread accumulates its columns in its own buffer.
+  static thread_local NN_Storage buff;
+  matrix_t* acc = nullptr;
+  if (!trans_b) {
+    buff.assign(j1 - j0, 0);
+    acc = buff.data();
+    _gemv_rows(j1 - j0, k, x, b + j0, ldb, acc);
+  }
+
+  for (int j = j0; j < j1; j += NN_GEMV_NB) {
+    int nb = (j1 - j < NN_GEMV_NB) ? j1 - j : NN_GEMV_NB;
+    matrix_t tile[NN_GEMV_NB];
+
+    if (trans_b) {
+      for (int c = 0; c < nb; c++) tile[c] = _dot(x, b + (size_t)(j + c) * ldb, k);
+    } else {
+      memcpy(tile, acc + (j - j0), nb * sizeof(matrix_t));
+    }
+
+    matrix_t* dst = y + j;
+    for (int c = 0; c < nb; c++) {
+      tile[c] = alpha * tile[c] + ((beta != 0) ? beta * dst[c] : 0);
+    }
+    if (ep != nullptr) _epilogue_row(ep, tile, j, nb);
+    memcpy(dst, tile, nb * sizeof(matrix_t));
+  }
+}
+
+// y (1 x n) = alpha * x (1 x k) * op(B) + beta * y, for the single sample
+// forward pass. B is read once, in its row major order (with a transposed B
+// every output is the dot product of two contiguous vectors). Large ones are split
+// by columns between the threads, in the shards of shard_cols().
+static void _gemv(
+    bool trans_b, int n, int k, matrix_t alpha,
+    const matrix_t* x, const matrix_t* b, int ldb,
+    matrix_t beta, matrix_t* y, const Epilogue* ep) {
+
+  if ((long long) n * k < NN_GEMV_PARALLEL || n <= NN_GEMV_NB) {
+    _gemv_range(trans_b, 0, n, k, alpha, x, b, ldb, beta, y, ep);
+    return;
+  }
+
+  parallel::parallel_each([&](int shard, int shards) {
+    int j0, j1;
+    shard_cols(n, shard, shards, j0, j1);
+    if (j0 < j1) _gemv_range(trans_b, j0, j1, k, alpha, x, b, ldb, beta, y, ep);
+  });
+}
+
+// The gemm below on the calling thread.
+static void _gemm_serial(
+    bool trans_a, bool trans_b,
+    int m, int n, int k, matrix_t alpha,
+    const matrix_t* a, int lda,
+    const matrix_t* b, int ldb,
+    matrix_t beta, matrix_t* c, int ldc,
+    const Epilogue* ep) {
+
+  if (m < NN_GEMM_MR || (long long)m * n * k <= NN_GEMM_SMALL) {
+    _gemm_small(trans_a, trans_b, m, n, k, alpha, a, lda, b, ldb, beta, c, ldc, ep);
+    return;
+  }
+
+  static thread_local NN_Storage buff_a;
+  static thread_local NN_Storage buff_b;
+
+  matrix_t* pack_a = _pack_buffer(buff_a, (size_t)(NN_GEMM_MC + NN_GEMM_MR) * NN_GEMM_KC);
+  matrix_t* pack_b = _pack_buffer(buff_b, (size_t)(NN_GEMM_NC + NN_GEMM_NR) * NN_GEMM_KC);
+
+  // Address of op(X)[row][col] for a matrix stored with leading dimension ld.
+  #define NN_GEMM_AT(x, trans, ld, row, col) \
+    ((trans) ? (x) + (size_t)(col) * (ld) + (row) : (x) + (size_t)(row) * (ld) + (col))
+
+  for (int jc = 0; jc < n; jc += NN_GEMM_NC) {
+    int nc = (n - jc < NN_GEMM_NC) ? n - jc : NN_GEMM_NC;
+
+    for (int pc = 0; pc < k; pc += NN_GEMM_KC) {
+      int kc = (k - pc < NN_GEMM_KC) ? k - pc : NN_GEMM_KC;
+
+      // Only the first pass over k applies beta, the rest accumulate, and
+      // only the last one runs the epilogue.
+      matrix_t beta_pc = (pc == 0) ? beta : 1;
+      bool last_pc = (pc + kc == k);
+
+      _pack_b(trans_b, kc, nc, NN_GEMM_AT(b, trans_b, ldb, pc, jc), ldb, pack_b);
+
+      for (int ic = 0; ic < m; ic += NN_GEMM_MC) {
+        int mc = (m - ic < NN_GEMM_MC) ? m - ic : NN_GEMM_MC;
+
+        _pack_a(trans_a, mc, kc, NN_GEMM_AT(a, trans_a, lda, ic, pc), lda, pack_a);
+
+        for (int jr = 0; jr < nc; jr += NN_GEMM_NR) {
+          int nr = (nc - jr < NN_GEMM_NR) ? nc - jr : NN_GEMM_NR;
+          const matrix_t* sliver_b = pack_b + (size_t)jr * kc;
+
+          for (int ir = 0; ir < mc; ir += NN_GEMM_MR) {
+            int mr = (mc - ir < NN_GEMM_MR) ? mc - ir : NN_GEMM_MR;
+            const matrix_t* sliver_a = pack_a + (size_t)ir * kc;
+
+            Epilogue tile_ep;
+            if (last_pc && ep != nullptr) {
+              tile_ep.activation = ep->activation;
+              tile_ep.bias = (ep->bias != nullptr) ? ep->bias + jc + jr : nullptr;
+            }
+
+            _kernel(
+              kc, sliver_a, sliver_b,
+              c + (ic + ir) * ldc + jc + jr, ldc,
+              mr, nr, alpha, beta_pc,
+              (last_pc && ep != nullptr) ? &tile_ep : nullptr);
+          }
+        }
+      }
+    }
+  }
+
+  #undef NN_GEMM_AT
+}
+
+// C = alpha * op(A) * op(B) + beta * C, where op(A) is (m x k) and op(B) is
+// (k x n). lda and ldb are the leading dimensions of A and B as stored, so
+// for a transposed A (stored k x m) lda >= m. The optional epilogue is
+// applied to C in the same pass.
+//
+// A large one is split in shards of the columns of C (shard_cols()), each
+// computed by its thread from all of op(A) and its columns of op(B). With
+// the layers that keeps the forward (C the outputs, B the weights) and the
+// weight update (C the weights) on the columns of the weights each thread
+// owns. The delta of the previous layer (B the transposed weights) is split
+// by the rows of the weights instead, every thread reading all the shards.
+static void gemm(
+    bool trans_a, bool trans_b,
+    int m, int n, int k, matrix_t alpha,
+    const matrix_t* a, int lda,
+    const matrix_t* b, int ldb,
+    matrix_t beta, matrix_t* c, int ldc,
+    const Epilogue* ep = nullptr) {
+
+  if (m == 0 || n == 0) return;
+
+  if (k == 0 || alpha == 0) {
+    _scale_c(m, n, beta, c, ldc);
+    for (int i = 0; i < m; i++) _epilogue_row(ep, c + i * ldc, 0, n);
+    return;
+  }
+
+  // A row vector times a matrix. A transposed one (stored as a column) is
+  // contiguous too unless it's padded.
+  if (m == 1 && (!trans_a || lda == 1)) {
+    _gemv(trans_b, n, k, alpha, a, b, ldb, beta, c, ep);
+    return;
+  }
+
+  if ((long long) m * n * k < NN_GEMM_PARALLEL || n < 2 * NN_GEMV_NB ||
+      parallel::Pool::instance().size() == 1) {
+    _gemm_serial(trans_a, trans_b, m, n, k, alpha, a, lda, b, ldb, beta, c, ldc, ep);
+    return;
+  }
+
+  parallel::parallel_each([&](int shard, int shards) {
+    int j0, j1;
+    shard_cols(n, shard, shards, j0, j1);
+    if (j0 == j1) return;
+
+    Epilogue shard_ep;
+    if (ep != nullptr) {
+      shard_ep.activation = ep->activation;
+      shard_ep.bias = (ep->bias != nullptr) ? ep->bias + j0 : nullptr;
+    }
+    const matrix_t* shard_b = trans_b ? b + (size_t) j0 * ldb : b + j0;
+    _gemm_serial(trans_a, trans_b, m, j1 - j0, k, alpha, a, lda, shard_b, ldb,
+                 beta, c + j0, ldc, (ep != nullptr) ? &shard_ep : nullptr);
+  });
+}
+
+// C = A * B.
+static inline void gemm(
+    int m, int n, int k,
+    const matrix_t* a, int lda,
+    const matrix_t* b, int ldb,
+    matrix_t* c, int ldc) {
+  gemm(false, false, m, n, k, 1, a, lda, b, ldb, 0, c, ldc);
+}
+
+} // namespace gemm
+
+#endif // GEMM_HPP_INCLUDED
@@ -0,0 +1,89 @@
+#pragma once
+
+#ifndef HOGWILD_HPP_INCLUDED
+#define HOGWILD_HPP_INCLUDED
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include "nn.hpp"
+#include "dataset.hpp"
+#include "parallel.hpp"
+
+// Asynchronous SGD in the way of Hogwild! (Niu et al.): every thread takes
+// the next batch of the epoch, runs it forward and back through the shared
+// NN with its own activations (an NN_Workspace), and updates the weights in
+// place without any locking. A thread may read weights another one is
+// writing, or overwrite its update, which the SGD shrugs off while the
+// updates are small and spread out, and there is nothing to wait for.
+//
+// The workers run on the parallel::Pool, worker w always on thread
+// w % size() (see Pool::run_each()) so its buffers stay on that thread's NUMA
+// node, at most as many at once as the pool has threads, and their gemms
+// don't start threads of their own. The dataset is read from every thread,
+// its get_batch() has to be safe for that (the ones of Dataset and DsIdx
+// are).
+class Hogwild {
+public:
+  Hogwild(NN& nn, int threads);
+
+  int threads() const;
+
+  // Mean squared error of the epoch, order is the samples in the order they
+  // are handed out.
+  float train_epoch(const Dataset& dataset, const std::vector<int>& order, int batch);
+
+private:
+  struct Worker {
+    NN_Workspace ws;
+    NN_Matrix inputs;
+    NN_Matrix expected;
+    std::vector<int> indices;
+    double cost = 0;
+  };
+
+  void _work(Worker& worker, const Dataset& dataset, const std::vector<int>& order, int batch);
+
+  NN& nn;
+  std::vector<Worker> workers; // Kept between the epochs, for the buffers.
+  std::atomic<int> next{ 0 };
+};
+
+Hogwild::Hogwild(NN& nn, int threads) : nn(nn), workers(threads > 0 ? threads : 1) {}
+
+int Hogwild::threads() const {
+  return (int) workers.size();
+}
+
+void Hogwild::_work(Worker& worker, const Dataset& dataset, const std::vector<int>& order, int batch) {
+  worker.cost = 0;
+  for (;;) {
+    int first = next.fetch_add(batch);
+    if (first >= (int) order.size()) break;
+    int count = std::min(batch, (int) order.size() - first);
+    worker.indices.assign(order.begin() + first, order.begin() + first + count);
+
+    dataset.get_batch(worker.indices, worker.inputs, worker.expected);
+    nn.forward(worker.inputs, worker.ws);
+    worker.cost += (worker.ws.outputs.back() - worker.expected).square().sum() / worker.expected.cols();
+    nn.backprop(worker.expected, worker.ws);
+  }
+}
+
+float Hogwild::train_epoch(const Dataset& dataset, const std::vector<int>& order, int batch) {
+  assert(batch >= 1);
+  next = 0;
+
+  // A thread with several workers runs them in turn, the first one takes
+  // whatever batches the other threads leave.
+  parallel::parallel_each([&](int thread, int threads) {
+    for (int w = thread; w < (int) workers.size(); w += threads) _work(workers[w], dataset, order, batch);
+  });
+
+  double cost = 0;
+  for (const Worker& worker : workers) cost += worker.cost;
+  return order.empty() ? 0.f : (float)(cost / order.size());
+}
+
+#endif // HOGWILD_HPP_INCLUDED
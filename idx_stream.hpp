@@ -0,0 +1,384 @@
+#pragma once
+
+#ifndef IDX_STREAM_HPP_INCLUDED
+#define IDX_STREAM_HPP_INCLUDED
+
+#include <algorithm>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif
+
+#include "dataset.hpp"
+
+// An IDX file of any value type and any number of dimensions, the first one
+// being the samples, read a chunk of samples at a time through an LRU cache
+// of a bounded size: the file can be far larger than the memory. The values
+// come out as matrix_t.
+class IdxReader {
+public:
+  // The third byte of the magic number.
+  enum Type { U8 = 0x08, I8 = 0x09, I16 = 0x0B, I32 = 0x0C, F32 = 0x0D, F64 = 0x0E };
+
+  // The chunks take about cache_bytes at most, one is a whole number of
+  // samples of about chunk_bytes (at least one sample). Chunks still being
+  // read from by other threads can add one each.
+  IdxReader(const char* path, size_t cache_bytes = 64 << 20, size_t chunk_bytes = 64 << 10);
+  ~IdxReader();
+  IdxReader(const IdxReader&) = delete;
+  IdxReader& operator=(const IdxReader&) = delete;
+
+  // Empty if the file is a valid IDX file, what's wrong otherwise.
+  static std::string check(const char* path);
+
+  Type type() const { return _type; }
+  int rank() const { return (int) _dims.size(); }
+  const std::vector<uint32_t>& dims() const { return _dims; }
+  int count() const { return (int) _dims[0]; }
+  // Values per sample, the product of the dimensions after the first.
+  int sample_size() const { return (int) _sample_values; }
+
+  // The sample_size() values of sample index divided by divisor into dst.
+  // Safe to call from several threads at once.
+  void read(int index, matrix_t* dst, matrix_t divisor = 1) const;
+
+  // Chunks found in the cache and read from the file.
+  size_t hits() const;
+  size_t misses() const;
+
+private:
+  typedef std::shared_ptr<const std::vector<uint8_t>> Chunk;
+  Chunk _chunk(size_t chunk) const;
+
+  static std::string _parse(FILE* file, Type& type, std::vector<uint32_t>& dims, uint64_t& header);
+
+  FILE* _file = NULL;
+  Type _type = U8;
+  std::vector<uint32_t> _dims;
+  uint64_t _header = 0;
+  size_t _value_bytes = 1;
+  size_t _sample_values = 1;
+  size_t _chunk_samples = 1;
+  size_t _max_chunks = 1;
+
+  mutable std::mutex _mutex;
+  mutable std::list<size_t> _lru; // Most recently used first.
+  mutable std::unordered_map<size_t, std::pair<Chunk, std::list<size_t>::iterator>> _cache;
+  mutable size_t _hits = 0;
+  mutable size_t _misses = 0;
+};
+
+// Offsets past 2 GB, for the files larger than the memory.
+static inline bool _idx_seek(FILE* file, uint64_t offset) {
+#if defined(_WIN32)
+  return _fseeki64(file, (long long) offset, SEEK_SET) == 0;
+#else
+  return fseeko(file, (off_t) offset, SEEK_SET) == 0;
+#endif
+}
+
+// At offset without moving the position of the file where there's pread(),
+// the processes forked after it's opened share that position.
+static inline bool _idx_read_at(FILE* file, uint64_t offset, void* dst, size_t bytes) {
+#if defined(_WIN32)
+  return _idx_seek(file, offset) && fread(dst, 1, bytes, file) == bytes;
+#else
+  size_t done = 0;
+  while (done < bytes) {
+    ssize_t n = pread(fileno(file), (char*) dst + done, bytes - done, (off_t)(offset + done));
+    if (n <= 0) return false;
+    done += (size_t) n;
+  }
+  return true;
+#endif
+}
+
+static inline uint64_t _idx_file_size(FILE* file) {
+#if defined(_WIN32)
+  _fseeki64(file, 0, SEEK_END);
+  long long size = _ftelli64(file);
+#else
+  fseeko(file, 0, SEEK_END);
+  off_t size = ftello(file);
+#endif
+  return size > 0 ? (uint64_t) size : 0;
+}
+
+static inline size_t _idx_value_bytes(int type) {
+  switch (type) {
+  case IdxReader::U8: case IdxReader::I8: return 1;
+  case IdxReader::I16: return 2;
+  case IdxReader::I32: case IdxReader::F32: return 4;
+  case IdxReader::F64: return 8;
+  default: return 0;
+  }
+}
+
+std::string IdxReader::_parse(FILE* file, Type& type, std::vector<uint32_t>& dims, uint64_t& header) {
+  const uint64_t size = _idx_file_size(file);
+  uint8_t magic[4];
+  if (!_idx_seek(file, 0) || fread(magic, 1, 4, file) != 4) return "too short for an IDX header";
+  if (magic[0] != 0 || magic[1] != 0 || _idx_value_bytes(magic[2]) == 0) return "not an IDX magic number";
+  if (magic[3] == 0) return "no dimensions";
+
+  type = (Type) magic[2];
+  dims.assign(magic[3], 0);
+  for (uint32_t& dim : dims) {
+    uint8_t bytes[4];
+    if (fread(bytes, 1, 4, file) != 4) return "too short for an IDX header";
+    const uint8_t* ptr = bytes;
+    dim = _idx_read_u32(ptr);
+  }
+  header = 4 + 4 * (uint64_t) dims.size();
+
+  uint64_t values = 1;
+  for (uint32_t dim : dims) {
+    if (dim != 0 && values > (size - header) / dim) return "shorter than its header says";
+    values *= dim;
+  }
+  if ((size - header) / _idx_value_bytes(type) < values) return "shorter than its header says";
+  return std::string();
+}
+
+std::string IdxReader::check(const char* path) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) return std::string("Cannot open ") + path;
+  Type type;
+  std::vector<uint32_t> dims;
+  uint64_t header;
+  std::string error = _parse(file, type, dims, header);
+  fclose(file);
+  return error.empty() ? error : std::string(path) + ": " + error;
+}
+
+IdxReader::IdxReader(const char* path, size_t cache_bytes, size_t chunk_bytes) {
+  _file = fopen(path, "rb");
+  assert(_file != NULL && "Cannot open the IDX file.");
+  std::string error = _parse(_file, _type, _dims, _header);
+  assert(error.empty());
+  (void) error;
+
+  _value_bytes = _idx_value_bytes(_type);
+  for (size_t i = 1; i < _dims.size(); i++) _sample_values *= _dims[i];
+  const size_t sample_bytes = _sample_values * _value_bytes;
+  _chunk_samples = std::max<size_t>(1, chunk_bytes / std::max<size_t>(1, sample_bytes));
+  _max_chunks = std::max<size_t>(1, cache_bytes / std::max<size_t>(1, _chunk_samples * sample_bytes));
+}
+
+IdxReader::~IdxReader() {
+  if (_file != NULL) fclose(_file);
+}
+
+size_t IdxReader::hits() const {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _hits;
+}
+
+size_t IdxReader::misses() const {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _misses;
+}
+
+// A missing chunk is read with the lock held, or the threads after the
+// same one would all read it.
+IdxReader::Chunk IdxReader::_chunk(size_t chunk) const {
+  std::lock_guard<std::mutex> lock(_mutex);
+  auto found = _cache.find(chunk);
+  if (found != _cache.end()) {
+    _hits++;
+    _lru.splice(_lru.begin(), _lru, found->second.second);
+    return found->second.first;
+  }
+
+  _misses++;
+  const size_t first = chunk * _chunk_samples;
+  const size_t samples = std::min(_chunk_samples, (size_t) count() - first);
+  const size_t bytes = samples * _sample_values * _value_bytes;
+  std::shared_ptr<std::vector<uint8_t>> data = std::make_shared<std::vector<uint8_t>>(bytes);
+  bool ok = _idx_read_at(_file, _header + (uint64_t) first * _sample_values * _value_bytes, data->data(), bytes);
+  assert(ok && "Cannot read the IDX file.");
+  (void) ok;
+
+  if (_cache.size() == _max_chunks) {
+    _cache.erase(_lru.back());
+    _lru.pop_back();
+  }
+  _lru.push_front(chunk);
+  _cache[chunk] = std::make_pair(Chunk(data), _lru.begin());
+  return data;
+}
+
+// The values are big endian, whatever their type.
+void IdxReader::read(int index, matrix_t* dst, matrix_t divisor) const {
+  assert(index >= 0 && index < count());
+  const size_t chunk = (size_t) index / _chunk_samples;
+  Chunk data = _chunk(chunk);
+  const uint8_t* p = data->data() + ((size_t) index - chunk * _chunk_samples) * _sample_values * _value_bytes;
+  const size_t n = _sample_values;
+
+  switch (_type) {
+  case U8:
+    for (size_t i = 0; i < n; i++) dst[i] = (matrix_t) p[i] / divisor;
+    break;
+  case I8:
+    for (size_t i = 0; i < n; i++) dst[i] = (matrix_t)(int8_t) p[i] / divisor;
+    break;
+  case I16:
+    for (size_t i = 0; i < n; i++, p += 2) dst[i] = (matrix_t)(int16_t)((p[0] << 8) | p[1]) / divisor;
+    break;
+  case I32:
+    for (size_t i = 0; i < n; i++) dst[i] = (matrix_t)(int32_t) _idx_read_u32(p) / divisor;
+    break;
+  case F32:
+    for (size_t i = 0; i < n; i++) {
+      uint32_t bits = _idx_read_u32(p);
+      float value;
+      memcpy(&value, &bits, sizeof value);
+      dst[i] = (matrix_t) value / divisor;
+    }
+    break;
+  case F64:
+    for (size_t i = 0; i < n; i++) {
+      uint64_t bits = (uint64_t) _idx_read_u32(p) << 32;
+      bits |= _idx_read_u32(p);
+      double value;
+      memcpy(&value, &bits, sizeof value);
+      dst[i] = (matrix_t)(value / divisor);
+    }
+    break;
+  }
+}
+
+
+// The samples of an IDX file of inputs and one of labels streamed through
+// IdxReader caches, for the datasets which don't fit in memory. u8 inputs
+// are scaled to [0, 1] as by DsIdx, the others are taken as they are.
+// Labels of a single dimension and an integer type are class indices and
+// give one-hot outputs of `classes` values, other labels are the outputs.
+class DsIdxStream : public Dataset {
+public:
+  // Each file gets a cache of cache_bytes.
+  DsIdxStream(const char* path_labels, const char* path_inputs, size_t cache_bytes);
+
+  // Empty if the files are a valid pair, what's wrong otherwise.
+  static std::string check(const char* path_labels, const char* path_inputs);
+
+  IdxReader labels;
+  IdxReader inputs;
+  int classes = 0; // 0 when the labels aren't class indices.
+
+  int count() const override;
+  int input_size() const;
+  int output_size() const;
+
+  NN_Matrix get_input(int index) const override;
+  NN_Matrix get_output(int index) const override;
+
+  void get_input_into(int index, NN_Matrix& dst) const override;
+  void get_output_into(int index, NN_Matrix& dst) const override;
+  void get_batch(const std::vector<int>& indices, NN_Matrix& out_inputs, NN_Matrix& out_labels) const override;
+
+private:
+  void _output_row(int index, matrix_t* dst) const;
+
+  matrix_t _divisor = 1;
+};
+
+static inline bool _idx_is_class(const IdxReader& labels) {
+  return labels.rank() == 1 && labels.type() != IdxReader::F32 && labels.type() != IdxReader::F64;
+}
+
+std::string DsIdxStream::check(const char* path_labels, const char* path_inputs) {
+  std::string error = IdxReader::check(path_labels);
+  if (error.empty()) error = IdxReader::check(path_inputs);
+  if (!error.empty()) return error;
+
+  IdxReader labels(path_labels, 0), inputs(path_inputs, 0);
+  if (labels.count() != inputs.count()) return std::string(path_labels) + ": not as many labels as inputs";
+  return std::string();
+}
+
+// Class indices are gone over once, a chunk at a time, for their count.
+DsIdxStream::DsIdxStream(const char* path_labels, const char* path_inputs, size_t cache_bytes)
+  : labels(path_labels, cache_bytes), inputs(path_inputs, cache_bytes) {
+  assert(labels.count() == inputs.count());
+  if (inputs.type() == IdxReader::U8) _divisor = 255.f;
+
+  if (_idx_is_class(labels)) {
+    for (int i = 0; i < labels.count(); i++) {
+      matrix_t label;
+      labels.read(i, &label);
+      assert(label >= 0 && "A class index is negative.");
+      if ((int) label + 1 > classes) classes = (int) label + 1;
+    }
+  }
+}
+
+int DsIdxStream::count() const {
+  return inputs.count();
+}
+
+int DsIdxStream::input_size() const {
+  return inputs.sample_size();
+}
+
+int DsIdxStream::output_size() const {
+  return classes > 0 ? classes : labels.sample_size();
+}
+
+void DsIdxStream::_output_row(int index, matrix_t* dst) const {
+  if (classes == 0) {
+    labels.read(index, dst);
+    return;
+  }
+  matrix_t label;
+  labels.read(index, &label);
+  memset(dst, 0, classes * sizeof(matrix_t));
+  dst[(int) label] = 1.f;
+}
+
+NN_Matrix DsIdxStream::get_input(int index) const {
+  NN_Matrix input;
+  get_input_into(index, input);
+  return input;
+}
+
+NN_Matrix DsIdxStream::get_output(int index) const {
+  NN_Matrix output;
+  get_output_into(index, output);
+  return output;
+}
+
+void DsIdxStream::get_input_into(int index, NN_Matrix& dst) const {
+  if (dst.rows() != 1 || dst.cols() != input_size()) dst.init(1, input_size());
+  inputs.read(index, dst.row(0), _divisor);
+}
+
+void DsIdxStream::get_output_into(int index, NN_Matrix& dst) const {
+  if (dst.rows() != 1 || dst.cols() != output_size()) dst.init(1, output_size());
+  _output_row(index, dst.row(0));
+}
+
+// Straight into the rows. In order, a batch is a chunk or two; shuffled,
+// its samples are all over the file and it's as fast as the cache holds
+// most of it.
+void DsIdxStream::get_batch(const std::vector<int>& indices, NN_Matrix& out_inputs, NN_Matrix& out_labels) const {
+  int batch = (int) indices.size();
+  if (out_inputs.rows() != batch || out_inputs.cols() != input_size()) out_inputs.init(batch, input_size());
+  if (out_labels.rows() != batch || out_labels.cols() != output_size()) out_labels.init(batch, output_size());
+  for (int i = 0; i < batch; i++) {
+    inputs.read(indices[i], out_inputs.row(i), _divisor);
+    _output_row(indices[i], out_labels.row(i));
+  }
+}
+
+#endif // IDX_STREAM_HPP_INCLUDED
@@ -3,6 +3,8 @@
 #ifndef LAYER_HPP_INCLUDED
 #define LAYER_HPP_INCLUDED
 
+#include "matrix.hpp"
+
 struct Layer {
     NN_Matrix outputs;
     NN_Matrix biased;
@@ -13,7 +15,11 @@ struct Layer {
 
     Layer next_layer(int neuron_count);
 
-    static void forward(Layer& curr, Layer& prev);
+    static void forward(Layer& curr, Layer& prev, simd::SigmoidMode mode = simd::SIGMOID_EXACT);
+    // The same with the activations kept outside of the layers: out from
+    // in, which stands for prev.outputs.
+    static void forward(NN_Matrix& out, const NN_Matrix& in, const Layer& curr, const Layer& prev,
+                        simd::SigmoidMode mode = simd::SIGMOID_EXACT);
 };
 
 Layer::Layer(int neuron_count) {
@@ -31,14 +37,21 @@ Layer Layer::next_layer(int neuron_count) {
   Layer next;
   next.outputs.init(1, neuron_count);
   next.biased.init(1, neuron_count);
-  this->weights.init(this->outputs.cols(), next.outputs.cols());
+  // Padded so every row of the weights starts on a cache line.
+  this->weights.init_padded(this->outputs.cols(), next.outputs.cols());
   return next;
 }
 
-void Layer::forward(Layer& curr, Layer& prev) {
-  curr.outputs = (
-    (prev.outputs * prev.weights) += curr.biased
-  ).sigmoid();
+// outputs = sigmoid(prev.outputs * prev.weights + biased), computed straight
+// into curr.outputs with the bias and the activation fused into the gemm.
+// With a batch (a sample per row) the bias is added to every row.
+void Layer::forward(Layer& curr, Layer& prev, simd::SigmoidMode mode) {
+  forward(curr.outputs, prev.outputs, curr, prev, mode);
+}
+
+void Layer::forward(NN_Matrix& out, const NN_Matrix& in, const Layer& curr, const Layer& prev,
+                    simd::SigmoidMode mode) {
+  out.linear_sigmoid(in, prev.weights, curr.biased, mode);
 }
 
 #endif // LAYER_HPP_INCLUDED
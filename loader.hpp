@@ -0,0 +1,193 @@
+#pragma once
+
+#ifndef LOADER_HPP_INCLUDED
+#define LOADER_HPP_INCLUDED
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "dataset.hpp"
+
+// Gets the next batches of an epoch ready while the current one trains:
+// threads of its own gather them (Dataset::get_batch(), which scales the
+// inputs) and augment them if asked to, into a ring of `depth` batches
+// whose matrices are kept from one epoch to the next. Batch b goes to
+// thread b % workers and slot b % depth, and is filled once batch
+// b - depth is given back.
+//
+// The threads are its own rather than jobs of the parallel::Pool for the
+// same reason as the stages of Pipeline: they wait for slots to be free.
+// A large get_batch() still splits its rows across the pool.
+class BatchLoader {
+public:
+  struct Batch {
+    NN_Matrix inputs;
+    NN_Matrix expected;
+    std::vector<int> indices; // In the dataset, of the rows.
+  };
+
+  // Where the time went, since start().
+  struct Stats {
+    int batches = 0;
+    int stalls = 0;         // Batches next() had to wait for.
+    double wait = 0;        // Seconds next() waited, the training input bound.
+    double load = 0;        // Seconds the threads spent on batches, summed.
+  };
+
+  BatchLoader(const Dataset& dataset, int depth = 2, int workers = 1);
+  ~BatchLoader();
+
+  // Called by the threads on every batch once it's gathered, to change its
+  // inputs (shift, noise...). It has to be safe for several threads at once.
+  std::function<void(Batch& batch)> augment;
+
+  // Starts on the batches of order, batch samples each (the last one can
+  // be smaller). order has to stay as it is until the epoch is over, or the
+  // next start().
+  void start(const std::vector<int>& order, int batch);
+
+  // The next batch in order, nullptr at the end of the epoch. It's the
+  // caller's until the next call.
+  const Batch* next();
+
+  Stats stats() const;
+
+private:
+  struct Slot {
+    Batch batch;
+    int ready = -1; // The batch it holds.
+  };
+
+  void _worker(int index);
+  bool _wait_slot(std::unique_lock<std::mutex>& lock, int b, unsigned seen);
+
+  const Dataset& dataset;
+  std::vector<Slot> slots;
+  const int workers;
+  std::vector<std::thread> threads;
+
+  mutable std::mutex mutex;
+  std::condition_variable wake;   // To the threads.
+  std::condition_variable filled; // To next().
+
+  // The epoch.
+  const std::vector<int>* order = nullptr;
+  int batch_size = 1;
+  int batches = 0;
+  unsigned epoch = 0;
+  int busy = 0;          // Threads still on the epoch.
+  int taken = 0;         // Batches next() handed out.
+  int released = 0;      // Batches given back, their slots are free.
+  bool abort = false;
+  bool stop = false;
+
+  Stats _stats;
+};
+
+BatchLoader::BatchLoader(const Dataset& dataset, int depth, int workers)
+  : dataset(dataset), slots(std::max(1, depth)), workers(std::max(1, workers)) {
+  for (int w = 0; w < this->workers; w++) threads.emplace_back(&BatchLoader::_worker, this, w);
+}
+
+BatchLoader::~BatchLoader() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stop = true;
+    abort = true;
+  }
+  wake.notify_all();
+  for (std::thread& t : threads) t.join();
+}
+
+void BatchLoader::start(const std::vector<int>& order, int batch) {
+  assert(batch >= 1);
+  std::unique_lock<std::mutex> lock(mutex);
+  // The threads leave what's left of the last epoch first.
+  abort = true;
+  wake.notify_all();
+  filled.wait(lock, [&] { return busy == 0; });
+
+  this->order = &order;
+  batch_size = batch;
+  batches = ((int) order.size() + batch - 1) / batch;
+  taken = 0;
+  released = 0;
+  for (Slot& slot : slots) slot.ready = -1;
+  _stats = Stats();
+
+  abort = false;
+  busy = workers;
+  epoch++;
+  wake.notify_all();
+}
+
+// Until slot b % depth is free, false if the epoch is given up.
+bool BatchLoader::_wait_slot(std::unique_lock<std::mutex>& lock, int b, unsigned seen) {
+  wake.wait(lock, [&] { return abort || epoch != seen || b < released + (int) slots.size(); });
+  return !abort && epoch == seen;
+}
+
+void BatchLoader::_worker(int index) {
+  unsigned seen = 0;
+  std::unique_lock<std::mutex> lock(mutex);
+  for (;;) {
+    wake.wait(lock, [&] { return stop || epoch != seen; });
+    if (stop) return;
+    seen = epoch;
+
+    for (int b = index; b < batches; b += workers) {
+      if (!_wait_slot(lock, b, seen)) break;
+      Slot& slot = slots[b % slots.size()];
+      const int first = b * batch_size;
+      const int count = std::min(batch_size, (int) order->size() - first);
+      lock.unlock();
+
+      auto begin = std::chrono::steady_clock::now();
+      Batch& batch = slot.batch;
+      batch.indices.assign(order->begin() + first, order->begin() + first + count);
+      dataset.get_batch(batch.indices, batch.inputs, batch.expected);
+      if (augment) augment(batch);
+      double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+      lock.lock();
+      slot.ready = b;
+      _stats.load += seconds;
+      filled.notify_all();
+    }
+
+    if (--busy == 0) filled.notify_all();
+  }
+}
+
+const BatchLoader::Batch* BatchLoader::next() {
+  std::unique_lock<std::mutex> lock(mutex);
+  // The last one is given back.
+  if (released != taken) {
+    released = taken;
+    wake.notify_all();
+  }
+  if (order == nullptr || taken == batches) return nullptr;
+
+  Slot& slot = slots[taken % slots.size()];
+  if (slot.ready != taken) {
+    auto begin = std::chrono::steady_clock::now();
+    filled.wait(lock, [&] { return slot.ready == taken; });
+    _stats.wait += std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    _stats.stalls++;
+  }
+  taken++;
+  _stats.batches++;
+  return &slot.batch;
+}
+
+BatchLoader::Stats BatchLoader::stats() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return _stats;
+}
+
+#endif // LOADER_HPP_INCLUDED
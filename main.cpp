@@ -22,6 +22,7 @@
   #include "nn.hpp"
   #include "utils.hpp"
   #include "ui.hpp"
+  #include "worker.hpp"
 #undef SINGLE_SOURCE_IMPL
 
 typedef unsigned int UINT;
@@ -31,24 +32,6 @@ using namespace std;
 const int width = 800;
 const int height = 600;
 
-float error(NN_Matrix& out, NN_Matrix& exp);
-
-float error(NN_Matrix& out, NN_Matrix& exp) {
-    return (out - exp).square().sum() / out.cols();
-}
-
-float train(NN & nn, Dataset& dataset, int index) {
-    float cost = 0.f;
-    if (index < dataset.count()) {
-        NN_Matrix expected = dataset.get_output(index);
-
-        nn.forward(dataset.get_input(index));
-        cost = error(nn.get_outputs(), expected);
-        nn.backprop(expected);
-    }
-    return cost;
-}
-
 int wmain()
 {
     DsMinist dset_train(
@@ -67,38 +50,32 @@ int wmain()
 
     UI ui(&nn, &dset_train, &dset_test);
 
-    Texture tex = LoadTextureFromImage(dset_train.images[0]);
+    Texture tex = LoadTextureFromImage(dset_train.gray_image(0));
     ui.set_texture(&tex);
 
+    // Trains nn on its own thread for 5 epochs, the frames only draw its
+    // snapshots.
+    TrainingWorker worker(nn, dset_train, 5);
+
     int data_index = 0;
 
     while (!WindowShouldClose()) {
         ui.handle_inputs();
 
+        // Anything else than training uses nn from this thread.
+        if (ui.get_state() != UI::TRAINING) worker.pause();
+
         switch (ui.get_state()) {
             case UI::TRAINING:
             {
-                if (nn.data_index == dset_train.count()) {
-                    nn.trained++;
-                        if (nn.trained >= 5) {
-                            ui.set_state(UI::IDLE);
-                            ui.training = false;
-                            ui.message("Model trained!");
-                            break;
-                    }
-                    nn.data_index = 0;
+                if (worker.finished()) {
+                    ui.set_state(UI::IDLE);
+                    ui.training = false;
+                    ui.message("Model trained!");
+                    break;
                 }
 
-                Image img = dset_train.images[nn.data_index];
-                if (IsTextureReady(tex)) UnloadTexture(tex);
-
-                tex = LoadTextureFromImage(img);
-                ui.set_texture(&tex);
-
-                float cost = train(nn, dset_train, nn.data_index);
-                ui.push_error(cost);
-
-                nn.data_index++;
+                if (!worker.running()) worker.resume(ui.iterating() ? 1 : -1);
                 break;
             }
 
@@ -110,7 +87,7 @@ int wmain()
                     data_index = 0;
                 }
 
-                Image img = dset_test.images[data_index];
+                Image img = dset_test.gray_image(data_index);
                 if (IsTextureReady(tex)) UnloadTexture(tex);
 
                 tex = LoadTextureFromImage(img);
@@ -123,6 +100,20 @@ int wmain()
             }
         }
 
+        if (worker.snapshots.update()) {
+            const TrainingSnapshot& snapshot = worker.snapshots.read();
+            if (snapshot.samples > 0) ui.push_error(snapshot.cost);
+
+            // The last sample it trained.
+            int index = snapshot.nn.data_index - 1;
+            if (ui.get_state() == UI::TRAINING && index >= 0 && index < dset_train.count()) {
+                if (IsTextureReady(tex)) UnloadTexture(tex);
+                tex = LoadTextureFromImage(dset_train.gray_image(index));
+                ui.set_texture(&tex);
+            }
+        }
+
+        ui.set_view(worker.running() ? &worker.snapshots.read().nn : &nn);
         ui.update();
 
         BeginDrawing();
@@ -0,0 +1,130 @@
+#pragma once
+
+#ifndef MAPPED_FILE_HPP_INCLUDED
+#define MAPPED_FILE_HPP_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#if defined(__unix__) || defined(__APPLE__)
+#define NN_MMAP 1
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+// A whole file read-only in memory. Where there is mmap it's a shared
+// mapping of the file: opening it is the same whatever its size, the pages
+// are read from the page cache as they're touched, and every process which
+// maps the file shares them. Elsewhere the file is read into a buffer.
+class MappedFile {
+public:
+  enum Advice { NORMAL, SEQUENTIAL, RANDOM, WILLNEED };
+
+  MappedFile() {}
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+  ~MappedFile() { close(); }
+
+  // False if it can't be opened (or mapped).
+  bool open(const char* path);
+  void close();
+
+  const uint8_t* data() const { return _data; }
+  size_t size() const { return _size; }
+  // Of the last modification, in seconds.
+  int64_t mtime() const { return _mtime; }
+
+  // How [offset, offset + bytes) is about to be read, for the read-ahead of
+  // the kernel. Nothing without mmap.
+  void advise(size_t offset, size_t bytes, Advice advice) const;
+
+private:
+  uint8_t* _data = nullptr;
+  size_t _size = 0;
+  int64_t _mtime = 0;
+  bool _mapped = false;
+};
+
+bool MappedFile::open(const char* path) {
+  close();
+#if defined(NN_MMAP)
+  int fd = ::open(path, O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    ::close(fd);
+    return false;
+  }
+
+  _size = (size_t) st.st_size;
+  _mtime = (int64_t) st.st_mtime;
+  if (_size > 0) {
+    void* data = mmap(NULL, _size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+      ::close(fd);
+      _size = 0;
+      return false;
+    }
+    _data = (uint8_t*) data;
+    _mapped = true;
+  }
+  // The mapping keeps the file.
+  ::close(fd);
+  return true;
+#else
+  struct stat st;
+  if (stat(path, &st) == 0) _mtime = (int64_t) st.st_mtime;
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) return false;
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  bool ok = size >= 0;
+  if (ok && size > 0) {
+    _data = (uint8_t*) malloc(size);
+    ok = _data != nullptr && fread(_data, 1, size, file) == (size_t) size;
+    _size = (size_t) size;
+  }
+  fclose(file);
+  if (!ok) close();
+  return ok;
+#endif
+}
+
+void MappedFile::close() {
+#if defined(NN_MMAP)
+  if (_mapped) munmap(_data, _size);
+#else
+  free(_data);
+#endif
+  _data = nullptr;
+  _size = 0;
+  _mtime = 0;
+  _mapped = false;
+}
+
+void MappedFile::advise(size_t offset, size_t bytes, Advice advice) const {
+#if defined(NN_MMAP)
+  if (!_mapped || offset >= _size) return;
+  if (bytes > _size - offset) bytes = _size - offset;
+
+  // madvise() wants the start on a page.
+  size_t page = (size_t) sysconf(_SC_PAGESIZE);
+  size_t begin = offset / page * page;
+  int flag = MADV_NORMAL;
+  if (advice == SEQUENTIAL) flag = MADV_SEQUENTIAL;
+  else if (advice == RANDOM) flag = MADV_RANDOM;
+  else if (advice == WILLNEED) flag = MADV_WILLNEED;
+  madvise(_data + begin, offset + bytes - begin, flag);
+#else
+  (void) offset;
+  (void) bytes;
+  (void) advice;
+#endif
+}
+
+#endif // MAPPED_FILE_HPP_INCLUDED
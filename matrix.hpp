@@ -3,80 +3,320 @@
 #ifndef MATRIX_HPP_INCLUDED
 #define MATRIX_HPP_INCLUDED
 
-#define assert(cond)             \
-  do {                           \
-    if (!(cond)) __debugbreak(); \
-  } while (false)
+#include "debug.hpp"
 
+#include <algorithm>
 #include <vector>
 #include <math.h>
 
 typedef float matrix_t;
 
-class NN_Matrix {
+#include "storage.hpp"
+#include "gemm.hpp"
+#include "simd.hpp"
+#include "matrix_expr.hpp"
+
+// A row major matrix in a NN_ALIGN aligned buffer. Rows are stride() values
+// apart, which is cols() unless the matrix was made with init_padded(), then
+// it's rounded up so that every row starts on an aligned boundary.
+class NN_Matrix : public NN_Expr<NN_Matrix> {
 public:
     NN_Matrix(int rows = 0, int cols= 0, matrix_t val = 0);
+
+    // Evaluate a lazy expression (see matrix_expr.hpp) in a single pass.
+    template <class E> NN_Matrix(const NN_Expr<E>& expr);
+    template <class E> NN_Matrix& operator=(const NN_Expr<E>& expr);
+    template <class E> NN_Matrix& operator+=(const NN_Expr<E>& expr);
+
+    // Reuses the current storage if it's large enough.
     NN_Matrix& init(int rows, int cols, matrix_t val = 0);
+    NN_Matrix& init_padded(int rows, int cols, matrix_t val = 0);
+    // init(rows, cols), except that a new buffer is zeroed by zero(data,
+    // size), see NN_Storage::assign_zero().
+    template <class F> NN_Matrix& init_zero(int rows, int cols, F&& zero);
+
+    // Makes it a zeroed rows x cols matrix (with the rows padded as by
+    // init_padded() if padded) on the values at data, which it doesn't own
+    // (see NN_Storage::view()). data is NN_ALIGN aligned, with room for
+    // view_size() values.
+    NN_Matrix& view(matrix_t* data, int rows, int cols, bool padded);
+    static size_t view_size(int rows, int cols, bool padded);
 
     matrix_t at(int row, int col) const;
     void set(int row, int col, matrix_t value);
 
-    std::vector<matrix_t>& data();
-    const std::vector<matrix_t>& data() const;
+    // The cols() values of a row.
+    matrix_t* row(int r);
+    const matrix_t* row(int r) const;
+
+    // The raw storage, rows() * stride() values.
+    NN_Storage& data();
+    const NN_Storage& data() const;
+
+    int stride() const;
+    bool contiguous() const; // No padding between the rows.
 
     void print() const;
 
-    int indexOfMax();
+    int indexOfMax() const;
     int rows() const;
     int cols() const;
 
     matrix_t sum() const;
     NN_Matrix& randomize(matrix_t min = 0, matrix_t max = 1);
-    NN_Matrix& sigmoid();
+    NN_Matrix& sigmoid(simd::SigmoidMode mode = simd::SIGMOID_EXACT);
     NN_Matrix& square();
-    NN_Matrix transpose() const;
-    NN_Matrix multiply(const NN_Matrix& other) const;
+    NN_Matrix transpose() const &;
+    NN_Matrix transpose() &&; // A row/column vector is only reshaped.
     NN_Matrix& multiply_inplace(const NN_Matrix& other); // Element by element.
 
+    // this (a row vector) += scale * the sum of the rows of m, e.g. the bias
+    // gradient of a batch.
+    NN_Matrix& add_row_sums(const NN_Matrix& m, matrix_t scale = 1);
+
+    // this = alpha * op(a) * op(b) + beta * this, where op() transposes its
+    // operand (read in place, no copy) if the flag is set. With beta == 0 the
+    // matrix is resized to the result if needed.
+    NN_Matrix& gemm(
+        const NN_Matrix& a, bool trans_a,
+        const NN_Matrix& b, bool trans_b,
+        matrix_t alpha = 1, matrix_t beta = 0);
+
+    // this = sigmoid(a * b + bias) in a single pass, the bias (a row vector
+    // added to every row) and the activation are applied by the gemm before
+    // the results are stored. Reuses the storage when the shape matches.
+    NN_Matrix& linear_sigmoid(const NN_Matrix& a, const NN_Matrix& b, const NN_Matrix& bias,
+                              simd::SigmoidMode mode = simd::SIGMOID_EXACT);
+
     // Operators
     NN_Matrix& operator+=(const NN_Matrix& other);
-
-    NN_Matrix operator-(const NN_Matrix& other) const;
     NN_Matrix operator*(const NN_Matrix& other) const;
-    NN_Matrix operator*(matrix_t value) const;
+
+    // Same as the operators above but write into dst, which keeps its storage
+    // if it's already large enough, so they don't allocate in a loop.
+    NN_Matrix& transpose_into(NN_Matrix& dst) const;
+    NN_Matrix& product_into(const NN_Matrix& other, NN_Matrix& dst) const; // this * other
+    NN_Matrix& multiply_into(const NN_Matrix& other, NN_Matrix& dst) const; // Element by element.
+
+    // Element-wise `-`, `+`, scalar `*` and multiply() are lazy, they are
+    // declared in matrix_expr.hpp.
+
+    // Expression interface, a matrix is a leaf.
+    bool aliases(const matrix_t* data) const;
+    const matrix_t* block(size_t row, size_t col, size_t n, matrix_t* out) const;
+
 private:
-    int _rows, _cols;
-    std::vector<matrix_t> _data;
+    template <class E> void _assign(const NN_Expr<E>& expr, bool accumulate);
+
+    // Calls fn(offset, n) over the storage of this and other (same shape)
+    // either once for everything or once per row if either is padded. A
+    // large one goes in pieces over the parallel::Pool, fn mustn't touch
+    // anything outside of its piece.
+    template <class F> void _for_rows(const NN_Matrix& other, F fn) const;
+
+    int _rows, _cols, _stride;
+    NN_Storage _data;
 };
 
-NN_Matrix::NN_Matrix(int rows, int cols, matrix_t val) : _rows(rows), _cols(cols), _data(rows * cols, val)
+NN_Matrix::NN_Matrix(int rows, int cols, matrix_t val) : _rows(rows), _cols(cols), _stride(cols), _data(rows * cols, val)
 {}
 
+template <class E>
+NN_Matrix::NN_Matrix(const NN_Expr<E>& expr) : _rows(0), _cols(0), _stride(0) {
+    _assign(expr, false);
+}
+
+template <class E>
+NN_Matrix& NN_Matrix::operator=(const NN_Expr<E>& expr) {
+    _assign(expr, false);
+    return *this;
+}
+
+template <class E>
+NN_Matrix& NN_Matrix::operator+=(const NN_Expr<E>& expr) {
+    assert(_rows == expr.self().rows() && _cols == expr.self().cols());
+    _assign(expr, true);
+    return *this;
+}
+
+bool NN_Matrix::aliases(const matrix_t* data) const {
+    return _data.data() == data;
+}
+
+// With contiguous storage, row 0 spans the whole matrix.
+const matrix_t* NN_Matrix::block(size_t row, size_t col, size_t /*n*/, matrix_t* /*out*/) const {
+    return _data.data() + row * _stride + col;
+}
+
+template <class F>
+void NN_Matrix::_for_rows(const NN_Matrix& other, F fn) const {
+    assert(_rows == other._rows && _cols == other._cols);
+    const size_t size = (size_t)_rows * _cols;
+    if (_stride == other._stride && (contiguous() || _rows == 0)) {
+        if (size < NN_EXPR_PARALLEL) {
+            fn((size_t)0, size, (size_t)0);
+            return;
+        }
+        parallel::parallel_for(0, (int) size, NN_EXPR_GRAIN, [&](int begin, int end) {
+            fn((size_t)begin, (size_t)(end - begin), (size_t)begin);
+        });
+        return;
+    }
+
+    auto rows = [&](int begin, int end) {
+        for (int r = begin; r < end; r++) {
+            fn((size_t)r * _stride, (size_t)_cols, (size_t)r * other._stride);
+        }
+    };
+    if (size < NN_EXPR_PARALLEL) rows(0, _rows);
+    else parallel::parallel_for(0, _rows, std::max(1, NN_EXPR_GRAIN / _cols), rows);
+}
+
+// Walk the destination once, block by block (row by row too when it or the
+// expression is padded). A block is computed right into the destination
+// unless the expression reads from this matrix, in that case through a
+// buffer so the values it still needs aren't overwritten.
+template <class E>
+void NN_Matrix::_assign(const NN_Expr<E>& expr, bool accumulate) {
+    const E& e = expr.self();
+    if (_rows != e.rows() || _cols != e.cols()) {
+        assert(!accumulate);
+        init(e.rows(), e.cols());
+    }
+
+    const bool alias = e.aliases(_data.data());
+    const bool flat = contiguous() && e.contiguous();
+    const size_t rows = flat ? (_rows > 0 ? 1 : 0) : _rows;
+    const size_t cols = flat ? (size_t)_rows * _cols : _cols;
+
+    // Block b is block b % blocks of row b / blocks.
+    const size_t blocks = (cols + NN_EXPR_BLOCK - 1) / NN_EXPR_BLOCK;
+    auto run = [&](size_t first, size_t last) {
+        matrix_t buff[NN_EXPR_BLOCK];
+        for (size_t b = first; b < last; b++) {
+            size_t r = b / blocks;
+            size_t c = (b % blocks) * NN_EXPR_BLOCK;
+            size_t n = (cols - c < NN_EXPR_BLOCK) ? cols - c : NN_EXPR_BLOCK;
+            matrix_t* dst = _data.data() + r * _stride + c;
+
+            if (accumulate) {
+                simd::kernels().add(dst, dst, e.block(r, c, n, buff), n);
+            } else {
+                const matrix_t* values = e.block(r, c, n, alias ? buff : dst);
+                if (values != dst) memcpy(dst, values, n * sizeof(matrix_t));
+            }
+        }
+    };
+
+    // The blocks only read the values they write, so they can go in any
+    // order, on any thread.
+    if (rows * cols < NN_EXPR_PARALLEL) {
+        run(0, rows * blocks);
+    } else {
+        parallel::parallel_for(0, (int)(rows * blocks), std::max(1, NN_EXPR_GRAIN / NN_EXPR_BLOCK), [&](int begin, int end) {
+            run(begin, end);
+        });
+    }
+}
+
+template <class F>
+NN_Matrix& NN_Matrix::init_zero(int rows, int cols, F&& zero) {
+    this->_rows = rows;
+    this->_cols = cols;
+    this->_stride = cols;
+    this->_data.assign_zero((size_t)rows * cols, zero);
+    return *this;
+}
+
+size_t NN_Matrix::view_size(int rows, int cols, bool padded) {
+    size_t stride = padded ? nn_align_up(cols, NN_ALIGN_FLOATS) : (size_t)cols;
+    return nn_align_up((size_t)rows * stride, NN_ALIGN_FLOATS);
+}
+
+NN_Matrix& NN_Matrix::view(matrix_t* data, int rows, int cols, bool padded) {
+    size_t capacity = view_size(rows, cols, padded);
+    this->_rows = 0;
+    this->_cols = 0;
+    this->_stride = 0;
+    this->_data.view(data, capacity);
+
+    // The large weights are zeroed by the threads of their shards.
+    if (padded) init_padded(rows, cols);
+    else init(rows, cols);
+    memset(data + _data.size(), 0, (capacity - _data.size()) * sizeof(matrix_t));
+    return *this;
+}
+
 NN_Matrix& NN_Matrix::init(int rows, int cols, matrix_t val) {
     this->_rows = rows;
     this->_cols = cols;
-    this->_data = std::vector<matrix_t>(rows * cols, val);
+    this->_stride = cols;
+    this->_data.assign(rows * cols, val);
+    return *this;
+}
+
+// The padding is zero and stays zero, the element-wise ops skip it.
+//
+// A large one (the weights of a wide layer) is zeroed by the threads in the
+// column shards the gemm splits it in, so every shard's pages end up on the
+// NUMA node of the thread which will compute them.
+NN_Matrix& NN_Matrix::init_padded(int rows, int cols, matrix_t val) {
+    this->_rows = rows;
+    this->_cols = cols;
+    this->_stride = (int) nn_align_up(cols, NN_ALIGN_FLOATS);
+
+    size_t size = (size_t)rows * _stride;
+    if (size < NN_GEMV_PARALLEL) {
+        this->_data.assign(size, 0);
+    } else {
+        int stride = _stride;
+        this->_data.assign_zero(size, [&](matrix_t* data, size_t) {
+            parallel::parallel_each([&](int shard, int shards) {
+                int j0, j1;
+                gemm::shard_cols(cols, shard, shards, j0, j1);
+                if (j1 == cols) j1 = stride; // The padding goes with the last shard.
+                if (j0 == j1) return;
+                for (int r = 0; r < rows; r++) {
+                    memset(data + (size_t)r * stride + j0, 0, (j1 - j0) * sizeof(matrix_t));
+                }
+            });
+        });
+    }
+    if (val != 0) {
+        for (int r = 0; r < rows; r++)
+            for (int c = 0; c < cols; c++) set(r, c, val);
+    }
     return *this;
 }
 
 NN_Matrix& NN_Matrix::randomize(matrix_t min, matrix_t max) {
 
     assert(max > min);
-    for (size_t i = 0; i < _data.size(); i++) {
-        matrix_t val = (matrix_t)((float)rand() / (float)RAND_MAX) * (max - min) + min;
-        _data[i] = val;
+    for (int r = 0; r < _rows; r++) {
+        for (int c = 0; c < _cols; c++) {
+            matrix_t val = (matrix_t)((float)rand() / (float)RAND_MAX) * (max - min) + min;
+            set(r, c, val);
+        }
     }
     return *this;
 }
 
-std::vector<matrix_t>& NN_Matrix::data() {
+NN_Storage& NN_Matrix::data() {
   return _data;
 }
 
-const std::vector<matrix_t>& NN_Matrix::data() const {
+const NN_Storage& NN_Matrix::data() const {
   return _data;
 }
 
+int NN_Matrix::stride() const {
+    return _stride;
+}
+
+bool NN_Matrix::contiguous() const {
+    return _stride == _cols || _rows <= 1;
+}
+
 void NN_Matrix::print() const {
     printf("[\n");
     for (int r = 0; r < _rows; r++) {
@@ -93,19 +333,18 @@ void NN_Matrix::print() const {
     printf("]\n");
 }
 
-int NN_Matrix::indexOfMax() {
-    matrix_t maximum = 0;
-    int index = 0;
-
-    for (int i = 0; i < _rows; i++) {
-        for (int j = 0; j < _cols; j++) {
-            if (_data[i, j] > maximum) {
-                maximum = _data[i, j];
-                index = i + j;
-            }
-        }
+// Index of the largest element in row major order (the column for a row
+// vector). The first one wins on a tie.
+int NN_Matrix::indexOfMax() const {
+    if (contiguous()) {
+        return (int) simd::kernels().argmax(_data.data(), (size_t)_rows * _cols);
     }
 
+    int index = 0;
+    for (int r = 0; r < _rows; r++) {
+        int c = (int) simd::kernels().argmax(_data.data() + (size_t)r * _stride, _cols);
+        if (at(r, c) > at(index / _cols, index % _cols)) index = r * _cols + c;
+    }
     return index;
 }
 
@@ -118,114 +357,172 @@ int NN_Matrix::cols() const {
 }
 
 matrix_t NN_Matrix::at(int row, int col) const {
-  return _data[row * _cols + col];
+  return _data[(size_t)row * _stride + col];
 }
 
 void NN_Matrix::set(int row, int col, matrix_t value) {
-    _data[row * _cols + col] = value;
+    _data[(size_t)row * _stride + col] = value;
+}
+
+matrix_t* NN_Matrix::row(int r) {
+    return _data.data() + (size_t)r * _stride;
+}
+
+const matrix_t* NN_Matrix::row(int r) const {
+    return _data.data() + (size_t)r * _stride;
 }
 
 matrix_t NN_Matrix::sum() const {
+    // Not through _for_rows(), the order of the additions stays the same.
+    if (contiguous()) return simd::kernels().sum(_data.data(), (size_t)_rows * _cols);
     matrix_t total = 0;
-    for (size_t i = 0; i < _data.size(); i++) {
-        total += _data[i];
+    for (int r = 0; r < _rows; r++) {
+        total += simd::kernels().sum(_data.data() + (size_t)r * _stride, _cols);
     }
     return total;
 }
 
-static inline matrix_t sigmoid(matrix_t x) {
-  return 1.f / (1.f + expf(-x));
+static inline matrix_t sigmoid(matrix_t x, simd::SigmoidMode mode = simd::SIGMOID_EXACT) {
+  return simd::sigmoid(x, mode);
 }
 
-NN_Matrix& NN_Matrix::sigmoid() {
-  for (size_t i = 0; i < _data.size(); i++) {
-    _data[i] = ::sigmoid(_data[i]);
-  }
+NN_Matrix& NN_Matrix::sigmoid(simd::SigmoidMode mode) {
+  simd::Unary kernel = simd::sigmoid_kernel(mode);
+  _for_rows(*this, [&](size_t offset, size_t n, size_t) {
+    kernel(_data.data() + offset, _data.data() + offset, n);
+  });
   return *this;
 }
 
 NN_Matrix& NN_Matrix::square() {
-    for (size_t i = 0; i < _data.size(); i++) {
-        _data[i] = _data[i] * _data[i];
-    }
+    _for_rows(*this, [&](size_t offset, size_t n, size_t) {
+        simd::kernels().square(_data.data() + offset, _data.data() + offset, n);
+    });
     return *this;
 }
 
-NN_Matrix NN_Matrix::transpose() const {
-    NN_Matrix m(_cols, _rows);
+NN_Matrix NN_Matrix::transpose() const & {
+    NN_Matrix m;
+    transpose_into(m);
+    return m;
+}
+
+NN_Matrix NN_Matrix::transpose() && {
+    if ((_rows == 1 || _cols == 1) && _stride == _cols) {
+        NN_Matrix m(std::move(*this));
+        std::swap(m._rows, m._cols);
+        m._stride = m._cols;
+        return m;
+    }
+    return transpose();
+}
+
+NN_Matrix& NN_Matrix::transpose_into(NN_Matrix& dst) const {
+    assert(&dst != this);
+    if (dst._rows != _cols || dst._cols != _rows) dst.init(_cols, _rows);
     for (int r = 0; r < _rows; r++) {
         for (int c = 0; c < _cols; c++) {
-            m.set(c, r, at(r, c));
+            dst.set(c, r, at(r, c));
         }
     }
-    return m;
+    return dst;
+}
+
+NN_Matrix& NN_Matrix::product_into(const NN_Matrix& other, NN_Matrix& dst) const {
+    return dst.gemm(*this, false, other, false);
 }
 
-NN_Matrix NN_Matrix::multiply(const NN_Matrix& other) const {
+NN_Matrix& NN_Matrix::multiply_into(const NN_Matrix& other, NN_Matrix& dst) const {
     assert(_rows == other._rows && _cols == other._cols);
-    NN_Matrix m(_rows, _cols);
-    for (size_t i = 0; i < _data.size(); i++) {
-        m._data[i] = _data[i] * other._data[i];
+    // dst goes by the offsets of this matrix, so it takes its stride too.
+    if (dst._rows != _rows || dst._cols != _cols || dst._stride != _stride) {
+        if (_stride != _cols) dst.init_padded(_rows, _cols);
+        else dst.init(_rows, _cols);
     }
-    return m;
+    _for_rows(other, [&](size_t offset, size_t n, size_t other_offset) {
+        simd::kernels().mul(dst._data.data() + offset, _data.data() + offset, other._data.data() + other_offset, n);
+    });
+    return dst;
 }
 
-NN_Matrix& NN_Matrix::multiply_inplace(const NN_Matrix& other) {
-    assert(_rows == other._rows && _cols == other._cols);
-    for (size_t i = 0; i < _data.size(); i++) {
-        _data[i] *= other._data[i];
+NN_Matrix& NN_Matrix::add_row_sums(const NN_Matrix& m, matrix_t scale) {
+    assert(_rows == 1 && _cols == m._cols);
+    for (int r = 0; r < m._rows; r++) {
+        simd::kernels().axpy(_data.data(), m.row(r), scale, _cols);
     }
     return *this;
 }
 
-// Operators
-NN_Matrix& NN_Matrix::operator+=(const NN_Matrix& other) {
-    bool cond = (_rows == other._rows && _cols == other._cols);
-    assert(_rows == other._rows && _cols == other._cols);
-    for (size_t i = 0; i < _data.size(); i++) {
-        _data[i] += other._data[i];
-    }
+NN_Matrix& NN_Matrix::multiply_inplace(const NN_Matrix& other) {
+    _for_rows(other, [&](size_t offset, size_t n, size_t other_offset) {
+        simd::kernels().mul(_data.data() + offset, _data.data() + offset, other._data.data() + other_offset, n);
+    });
     return *this;
 }
 
-NN_Matrix NN_Matrix::operator-(const NN_Matrix& other) const {
-    assert(_rows == other._rows && _cols == other._cols);
-    NN_Matrix m(this->_rows, this->_cols);
-    for (size_t i = 0; i < _data.size(); i++) {
-        m._data[i] = this->_data[i] - other._data[i];
+NN_Matrix& NN_Matrix::gemm(
+    const NN_Matrix& a, bool trans_a,
+    const NN_Matrix& b, bool trans_b,
+    matrix_t alpha, matrix_t beta) {
+
+    int m = trans_a ? a._cols : a._rows;
+    int k = trans_a ? a._rows : a._cols;
+    int n = trans_b ? b._rows : b._cols;
+    assert(k == (trans_b ? b._cols : b._rows));
+    assert(this != &a && this != &b);
+
+    if (_rows != m || _cols != n) {
+        assert(beta == 0);
+        init(m, n);
     }
-    return m;
+
+    gemm::gemm(
+        trans_a, trans_b, m, n, k, alpha,
+        a._data.data(), a._stride,
+        b._data.data(), b._stride,
+        beta, _data.data(), _stride);
+
+    return *this;
 }
 
-NN_Matrix NN_Matrix::operator*(const NN_Matrix& other) const {
+NN_Matrix& NN_Matrix::linear_sigmoid(const NN_Matrix& a, const NN_Matrix& b, const NN_Matrix& bias,
+                                     simd::SigmoidMode mode) {
+    assert(a._cols == b._rows);
+    assert(bias._rows == 1 && bias._cols == b._cols);
+    assert(this != &a && this != &b && this != &bias);
 
-  // (r1 x c1) * (r2 x c2) =>
-  //   assert(c1 == r2), result = (r1 x c2)
-  assert(this->_cols == other._rows);
+    if (_rows != a._rows || _cols != b._cols) init(a._rows, b._cols);
 
-  NN_Matrix m(this->_rows, other._cols);
+    gemm::Epilogue ep;
+    ep.bias = bias._data.data();
+    ep.activation = simd::sigmoid_kernel(mode);
 
-  int n = _cols; // Width or a row.
-  for (int r = 0; r < m._rows; r++) {
-    for (int c = 0; c < m._cols; c++) {
+    gemm::gemm(
+        false, false, a._rows, b._cols, a._cols, 1,
+        a._data.data(), a._stride,
+        b._data.data(), b._stride,
+        0, _data.data(), _stride,
+        &ep);
 
-      matrix_t val = 0;
-      for (int i = 0; i < n; i++) {
-        val += this->at(r, i) * other.at(i, c);
-      }
-      m.set(r, c, val);
-    }
-  }
+    return *this;
+}
 
-  return m;
+// Operators
+NN_Matrix& NN_Matrix::operator+=(const NN_Matrix& other) {
+    _for_rows(other, [&](size_t offset, size_t n, size_t other_offset) {
+        simd::kernels().add(_data.data() + offset, _data.data() + offset, other._data.data() + other_offset, n);
+    });
+    return *this;
 }
 
-NN_Matrix NN_Matrix::operator*(matrix_t value) const {
-  NN_Matrix m(_rows, _cols);
-  std::vector<matrix_t>& m_data = m.data();
-  for (size_t i = 0; i < _data.size(); i++) {
-    m_data[i] = _data[i] * value;
-  }
+NN_Matrix NN_Matrix::operator*(const NN_Matrix& other) const {
+
+  // (r1 x c1) * (r2 x c2) =>
+  //   assert(c1 == r2), result = (r1 x c2)
+  assert(this->_cols == other._rows);
+
+  NN_Matrix m;
+  product_into(other, m);
   return m;
 }
 
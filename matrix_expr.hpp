@@ -0,0 +1,258 @@
+#pragma once
+
+#ifndef MATRIX_EXPR_HPP_INCLUDED
+#define MATRIX_EXPR_HPP_INCLUDED
+
+#include <stddef.h>
+#include <type_traits>
+#include <utility>
+
+#include "simd.hpp"
+
+// Lazy element-wise expressions over NN_Matrix.
+//
+// `a - b`, `m * s`, `1 - m`, `a.multiply(b)` and `e.square()` don't compute
+// anything, they build a small tree of nodes which is evaluated when it's
+// assigned to a matrix (or reduced with sum()). The evaluation walks the destination once
+// in blocks of NN_EXPR_BLOCK elements, every node runs its SIMD kernel on a
+// block which stays in L1, so a chain of operations costs one pass over the
+// memory and no heap temporaries.
+//
+// A node holds a matrix it was built from by reference, except when the
+// matrix was a temporary (e.g. the result of a gemm), then it's moved into
+// the node. Nodes are held by value.
+
+#define NN_EXPR_BLOCK 256
+
+// Assignments (and the in-place ops of NN_Matrix) of at least NN_EXPR_PARALLEL
+// values are split over the parallel::Pool, in pieces of NN_EXPR_GRAIN.
+#define NN_EXPR_PARALLEL (256 * 1024)
+#define NN_EXPR_GRAIN (32 * 1024)
+
+class NN_Matrix;
+
+// Every expression E provides:
+//   int rows() const; int cols() const;
+//   bool contiguous() const;                    no row padding anywhere?
+//   bool aliases(const matrix_t* data) const;   reads from that storage?
+//   const matrix_t* block(size_t row, size_t col, size_t n, matrix_t* out) const;
+// block() returns the n values starting at (row, col), either written to out
+// or (for a matrix) a pointer straight into its storage. When contiguous()
+// the whole expression is walked as row 0, with col going up to the size.
+template <class E>
+struct NN_Expr {
+  const E& self() const { return static_cast<const E&>(*this); }
+
+  size_t size() const { return (size_t) self().rows() * self().cols(); }
+
+  // Element by element product.
+  template <class R> auto multiply(R&& other) const &;
+  template <class R> auto multiply(R&& other) &&;
+
+  auto square() const &;
+  auto square() &&;
+
+  matrix_t sum() const;
+};
+
+template <class T>
+struct nn_is_expr : std::is_base_of<NN_Expr<std::decay_t<T>>, std::decay_t<T>> {};
+
+// How a node stores an operand: a matrix lvalue by reference, anything else
+// (nodes, and matrix temporaries) by value.
+template <class T>
+using nn_expr_hold = std::conditional_t<
+  std::is_lvalue_reference<T>::value && std::is_same<std::decay_t<T>, NN_Matrix>::value,
+  const NN_Matrix&,
+  std::decay_t<T>>;
+
+
+struct NN_OpAdd {
+  static void apply(matrix_t* dst, const matrix_t* a, const matrix_t* b, size_t n) {
+    simd::kernels().add(dst, a, b, n);
+  }
+};
+
+struct NN_OpSub {
+  static void apply(matrix_t* dst, const matrix_t* a, const matrix_t* b, size_t n) {
+    simd::kernels().sub(dst, a, b, n);
+  }
+};
+
+struct NN_OpMul {
+  static void apply(matrix_t* dst, const matrix_t* a, const matrix_t* b, size_t n) {
+    simd::kernels().mul(dst, a, b, n);
+  }
+};
+
+
+template <class L, class R, class Op>
+struct NN_ExprBinary : NN_Expr<NN_ExprBinary<L, R, Op>> {
+  L lhs;
+  R rhs;
+
+  template <class A, class B>
+  NN_ExprBinary(A&& lhs, B&& rhs) : lhs(std::forward<A>(lhs)), rhs(std::forward<B>(rhs)) {
+    assert(this->lhs.rows() == this->rhs.rows() && this->lhs.cols() == this->rhs.cols());
+  }
+
+  int rows() const { return lhs.rows(); }
+  int cols() const { return lhs.cols(); }
+
+  bool contiguous() const { return lhs.contiguous() && rhs.contiguous(); }
+
+  bool aliases(const matrix_t* data) const {
+    return lhs.aliases(data) || rhs.aliases(data);
+  }
+
+  const matrix_t* block(size_t row, size_t col, size_t n, matrix_t* out) const {
+    matrix_t buff[NN_EXPR_BLOCK];
+    const matrix_t* a = lhs.block(row, col, n, out);
+    const matrix_t* b = rhs.block(row, col, n, buff);
+    Op::apply(out, a, b, n);
+    return out;
+  }
+};
+
+
+template <class E>
+struct NN_ExprScale : NN_Expr<NN_ExprScale<E>> {
+  E expr;
+  matrix_t value;
+
+  template <class A>
+  NN_ExprScale(A&& expr, matrix_t value) : expr(std::forward<A>(expr)), value(value) {}
+
+  int rows() const { return expr.rows(); }
+  int cols() const { return expr.cols(); }
+  bool contiguous() const { return expr.contiguous(); }
+  bool aliases(const matrix_t* data) const { return expr.aliases(data); }
+
+  const matrix_t* block(size_t row, size_t col, size_t n, matrix_t* out) const {
+    simd::kernels().scale(out, expr.block(row, col, n, out), value, n);
+    return out;
+  }
+};
+
+
+// expr * scale + shift, for the scalar + and - (e.g. the `1 - a` of the
+// sigmoid derivative without a matrix full of ones).
+template <class E>
+struct NN_ExprAffine : NN_Expr<NN_ExprAffine<E>> {
+  E expr;
+  matrix_t scale, shift;
+
+  template <class A>
+  NN_ExprAffine(A&& expr, matrix_t scale, matrix_t shift)
+    : expr(std::forward<A>(expr)), scale(scale), shift(shift) {}
+
+  int rows() const { return expr.rows(); }
+  int cols() const { return expr.cols(); }
+  bool contiguous() const { return expr.contiguous(); }
+  bool aliases(const matrix_t* data) const { return expr.aliases(data); }
+
+  const matrix_t* block(size_t row, size_t col, size_t n, matrix_t* out) const {
+    simd::kernels().axpb(out, expr.block(row, col, n, out), scale, shift, n);
+    return out;
+  }
+};
+
+
+template <class E>
+struct NN_ExprSquare : NN_Expr<NN_ExprSquare<E>> {
+  E expr;
+
+  template <class A>
+  explicit NN_ExprSquare(A&& expr) : expr(std::forward<A>(expr)) {}
+
+  int rows() const { return expr.rows(); }
+  int cols() const { return expr.cols(); }
+  bool contiguous() const { return expr.contiguous(); }
+  bool aliases(const matrix_t* data) const { return expr.aliases(data); }
+
+  const matrix_t* block(size_t row, size_t col, size_t n, matrix_t* out) const {
+    simd::kernels().square(out, expr.block(row, col, n, out), n);
+    return out;
+  }
+};
+
+
+template <class E>
+template <class R>
+auto NN_Expr<E>::multiply(R&& other) const & {
+  static_assert(nn_is_expr<R>::value, "multiply() needs a matrix expression");
+  return NN_ExprBinary<nn_expr_hold<const E&>, nn_expr_hold<R>, NN_OpMul>(self(), std::forward<R>(other));
+}
+
+template <class E>
+template <class R>
+auto NN_Expr<E>::multiply(R&& other) && {
+  static_assert(nn_is_expr<R>::value, "multiply() needs a matrix expression");
+  return NN_ExprBinary<nn_expr_hold<E>, nn_expr_hold<R>, NN_OpMul>(
+    std::move(*static_cast<E*>(this)), std::forward<R>(other));
+}
+
+template <class E>
+auto NN_Expr<E>::square() const & {
+  return NN_ExprSquare<nn_expr_hold<const E&>>(self());
+}
+
+template <class E>
+auto NN_Expr<E>::square() && {
+  return NN_ExprSquare<nn_expr_hold<E>>(std::move(*static_cast<E*>(this)));
+}
+
+template <class E>
+matrix_t NN_Expr<E>::sum() const {
+  const bool flat = self().contiguous();
+  const size_t rows = flat ? (size() > 0 ? 1 : 0) : self().rows();
+  const size_t cols = flat ? size() : self().cols();
+
+  matrix_t buff[NN_EXPR_BLOCK];
+  matrix_t total = 0;
+  for (size_t r = 0; r < rows; r++) {
+    for (size_t c = 0; c < cols; c += NN_EXPR_BLOCK) {
+      size_t n = (cols - c < NN_EXPR_BLOCK) ? cols - c : NN_EXPR_BLOCK;
+      total += simd::kernels().sum(self().block(r, c, n, buff), n);
+    }
+  }
+  return total;
+}
+
+
+template <class L, class R, class = std::enable_if_t<nn_is_expr<L>::value && nn_is_expr<R>::value>>
+auto operator+(L&& lhs, R&& rhs) {
+  return NN_ExprBinary<nn_expr_hold<L>, nn_expr_hold<R>, NN_OpAdd>(std::forward<L>(lhs), std::forward<R>(rhs));
+}
+
+template <class L, class R, class = std::enable_if_t<nn_is_expr<L>::value && nn_is_expr<R>::value>>
+auto operator-(L&& lhs, R&& rhs) {
+  return NN_ExprBinary<nn_expr_hold<L>, nn_expr_hold<R>, NN_OpSub>(std::forward<L>(lhs), std::forward<R>(rhs));
+}
+
+template <class E, class = std::enable_if_t<nn_is_expr<E>::value>>
+auto operator*(E&& expr, matrix_t value) {
+  return NN_ExprScale<nn_expr_hold<E>>(std::forward<E>(expr), value);
+}
+
+template <class E, class = std::enable_if_t<nn_is_expr<E>::value>>
+auto operator*(matrix_t value, E&& expr) {
+  return NN_ExprScale<nn_expr_hold<E>>(std::forward<E>(expr), value);
+}
+
+template <class E, class = std::enable_if_t<nn_is_expr<E>::value>>
+auto operator+(E&& expr, matrix_t value) {
+  return NN_ExprAffine<nn_expr_hold<E>>(std::forward<E>(expr), 1, value);
+}
+
+template <class E, class = std::enable_if_t<nn_is_expr<E>::value>>
+auto operator-(E&& expr, matrix_t value) {
+  return NN_ExprAffine<nn_expr_hold<E>>(std::forward<E>(expr), 1, -value);
+}
+
+template <class E, class = std::enable_if_t<nn_is_expr<E>::value>>
+auto operator-(matrix_t value, E&& expr) {
+  return NN_ExprAffine<nn_expr_hold<E>>(std::forward<E>(expr), -1, value);
+}
+
+#endif // MATRIX_EXPR_HPP_INCLUDED
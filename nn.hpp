@@ -3,66 +3,138 @@
 #ifndef NN_HPP_INCLUDED
 #define NN_HPP_INCLUDED
 
-#define assert(cond)             \
-  do {                           \
-    if (!(cond)) __debugbreak(); \
-  } while (false)
+#include "debug.hpp"
 
 #include <vector>
+#include <string>
 #include <fstream>
 
 #include "matrix.hpp"
 #include "layer.hpp"
 
-static void write_matrix(std::ofstream& file, const NN_Matrix& m) {
-    int rows = m.rows(), cols = m.cols();
-    assert(m.data().size() == rows * cols);
+// A saved NN starts with it, the files from before it had a matrix after the
+// other (see NN::load()).
+#define NN_FILE_MAGIC 0x314E4E50 // "PNN1"
 
-    file.write((const char*) &rows, sizeof rows);
-    file.write((const char*) &cols, sizeof cols);
-
-    for (matrix_t val : m.data()) {
-        file.write((const char*)&val, sizeof val);
-    }
-}
-
-
-static NN_Matrix read_matrix(std::ifstream& file) {
+// A matrix of the old files, the values without the row padding.
+static NN_Matrix read_matrix(std::ifstream& file, bool padded = false) {
     int rows, cols;
     file.read((char*)&rows, sizeof rows);
     file.read((char*)&cols, sizeof cols);
     assert(rows >= 0 && cols >= 0);
 
-    NN_Matrix m(rows, cols);
-    std::vector<matrix_t>& data = m.data();
-    for (size_t i = 0; i < rows * cols; i++) {
-        matrix_t val;
-        file.read((char*)&val, sizeof val);
-        data[i] = val;
+    NN_Matrix m;
+    if (padded) m.init_padded(rows, cols);
+    else m.init(rows, cols);
+
+    matrix_t* data = m.data().data();
+    for (int r = 0; r < rows; r++) {
+        file.read((char*)(data + (size_t)r * m.stride()), cols * sizeof(matrix_t));
     }
 
     return m;
 }
 
 
+// The activations and the backprop scratch of one training thread, for
+// several threads sharing the weights of a NN (see hogwild.hpp and
+// data_parallel.hpp). Sized by the first sample, then reused.
+struct NN_Workspace {
+    std::vector<NN_Matrix> outputs; // One per layer, outputs[0] is the input.
+    NN_Matrix delta;
+    NN_Matrix delta_next;
+
+    // Filled by NN::compute_gradients(), shaped like the weights and the
+    // biases of each layer (the last layer has no weights), views into
+    // grad_params which is laid out like NN::params (see
+    // NN::bind_gradients()).
+    std::vector<NN_Matrix> grad_weights;
+    std::vector<NN_Matrix> grad_biased;
+    NN_Matrix grad_params;
+};
+
+
 struct NN {
     matrix_t learn_rate = 0.01;
+    // Accuracy of the activations, not saved with the network.
+    simd::SigmoidMode sigmoid_mode = simd::SIGMOID_EXACT;
     std::vector<Layer> layers;
     std::vector<std::string> output_labels;
 
+    // The biases and the weights of every layer, one after the other in a
+    // single row, each part NN_ALIGN aligned. The biased and weights of the
+    // layers are views into it, so a step of the whole model is one pass
+    // over it, a checkpoint one write and the gradients to all-reduce one
+    // buffer (NN_Workspace::grad_params).
+    NN_Matrix params;
+
     int trained = 0;
     int data_index = 0;
 
+    // Scratch for backprop, kept between the samples so a training step
+    // doesn't allocate once the shapes are known.
+    NN_Matrix delta;
+    NN_Matrix delta_next;
+
     NN();
     NN(const std::vector<int>& config, const std::vector<std::string>& output_labels);
 
     NN_Matrix& get_outputs();
 
+    // Size the activations and the backprop scratch for batches of up to
+    // batch rows, so changing the batch size later doesn't allocate.
+    void reserve_batch(int batch);
+
+    // A batch is a matrix with a sample per row (B x inputs), the outputs
+    // then have a row per sample too. backprop() applies the gradient
+    // averaged over the batch.
     void forward(const NN_Matrix& input);
     void backprop(const NN_Matrix& expected);
 
+    // The same with the activations in ws instead of the layers. The weights
+    // are updated in place, with no locking.
+    void forward(const NN_Matrix& input, NN_Workspace& ws) const;
+    void backprop(const NN_Matrix& expected, NN_Workspace& ws);
+
+    // backprop() in two steps: the gradients of the batch in ws (after a
+    // forward() into ws), summed over its rows, leaving the weights alone,
+    // then weights += scale * gradients. With scale = -learn_rate / B it's
+    // the step of backprop(), except every delta uses the weights from
+    // before the update.
+    void compute_gradients(const NN_Matrix& expected, NN_Workspace& ws);
+    void apply_gradients(const NN_Workspace& ws, matrix_t scale);
+
+    // Lays ws.grad_params out like params, zeroed, with the gradients of ws
+    // views into it. compute_gradients() does it if it isn't yet.
+    void bind_gradients(NN_Workspace& ws) const;
+
+    // Copies the layers and the progress into dst, reusing its storage, so
+    // another thread can look at them while this one keeps training.
+    void copy_to(NN& dst) const;
+
     void save(const char* path) const;
     void load(const char* path);
+
+    // The size of params for layers of these neurons, before there is a NN.
+    static size_t param_count(const std::vector<int>& neurons);
+    // The neurons of every layer saved in path, in either format, empty if
+    // it can't be read.
+    static std::vector<int> saved_layers(const char* path);
+
+private:
+    // Where the biases (2 * i) and the weights (2 * i + 1) of layer i start
+    // in params, the last one is its size.
+    std::vector<size_t> _param_offsets() const;
+    static std::vector<size_t> _param_offsets(const std::vector<int>& neurons);
+    // Moves the biases and the weights of the layers into a new params.
+    void _bind_params();
+    bool _gradients_bound(const NN_Workspace& ws) const;
+
+    // outputs(i) is the activations of layer i. The gradients go to grads if
+    // it's set, otherwise straight into the weights.
+    template <class Outputs>
+    void _backprop(const NN_Matrix& expected, Outputs outputs, NN_Matrix& delta, NN_Matrix& delta_next,
+                   NN_Workspace* grads = nullptr);
 };
 
 NN::NN() {};
@@ -70,7 +142,7 @@ NN::NN() {};
 NN::NN(const std::vector<int>& config, const std::vector<std::string>& output_labels)
     : output_labels(output_labels) {
         assert(config.size() >= 1);
-        assert(output_labels.size() == config.at(config.size() - 1));
+        assert((int) output_labels.size() == config.at(config.size() - 1));
 
         for (size_t i = 0; i < config.size(); i++) {
             int neurons_count = config[i];
@@ -81,6 +153,7 @@ NN::NN(const std::vector<int>& config, const std::vector<std::string>& output_la
               layers.push_back(prev.next_layer(neurons_count));
             }
         }
+        _bind_params();
 
         for (Layer& layer : layers) {
             layer.weights.randomize(-.5, .5);
@@ -91,67 +164,251 @@ NN_Matrix& NN::get_outputs() {
     return layers[layers.size() - 1].outputs;
 }
 
+void NN::reserve_batch(int batch) {
+    assert(batch >= 1);
+    int widest = 0;
+    for (Layer& layer : layers) {
+        int rows = layer.outputs.rows();
+        layer.outputs.init(batch, layer.outputs.cols());
+        layer.outputs.init(rows, layer.outputs.cols());
+        if (layer.outputs.cols() > widest) widest = layer.outputs.cols();
+    }
+    delta.init(batch, widest);
+    delta_next.init(batch, widest);
+}
+
 
 void NN::forward(const NN_Matrix& input) {
     layers[0].outputs = input;
     for (size_t i = 1; i < layers.size(); i++) {
         Layer& curr = layers[i];
         Layer& prev = layers[i - 1];
-        Layer::forward(curr, prev);
+        Layer::forward(curr, prev, sigmoid_mode);
+    }
+}
+
+void NN::forward(const NN_Matrix& input, NN_Workspace& ws) const {
+    ws.outputs.resize(layers.size());
+    ws.outputs[0] = input;
+    for (size_t i = 1; i < layers.size(); i++) {
+        Layer::forward(ws.outputs[i], ws.outputs[i - 1], layers[i], layers[i - 1], sigmoid_mode);
     }
 }
 
 void NN::backprop(const NN_Matrix& expected) {
-    NN_Matrix& output = layers[layers.size() - 1].outputs;
+    _backprop(expected, [&](size_t i) -> NN_Matrix& { return layers[i].outputs; }, delta, delta_next);
+}
+
+void NN::backprop(const NN_Matrix& expected, NN_Workspace& ws) {
+    assert(ws.outputs.size() == layers.size());
+    _backprop(expected, [&](size_t i) -> NN_Matrix& { return ws.outputs[i]; }, ws.delta, ws.delta_next);
+}
+
+void NN::compute_gradients(const NN_Matrix& expected, NN_Workspace& ws) {
+    assert(ws.outputs.size() == layers.size());
+    if (!_gradients_bound(ws)) bind_gradients(ws);
+    _backprop(expected, [&](size_t i) -> NN_Matrix& { return ws.outputs[i]; }, ws.delta, ws.delta_next, &ws);
+}
+
+// The parts of params which aren't a gradient (the biases of the input
+// layer, the padding) have a zero one, a single pass is the whole step.
+void NN::apply_gradients(const NN_Workspace& ws, matrix_t scale) {
+    assert(_gradients_bound(ws));
+    params += ws.grad_params * scale;
+}
+
+std::vector<size_t> NN::_param_offsets() const {
+    std::vector<int> neurons;
+    for (const Layer& layer : layers) neurons.push_back(layer.biased.cols());
+    return _param_offsets(neurons);
+}
+
+// The last layer has no weights.
+std::vector<size_t> NN::_param_offsets(const std::vector<int>& neurons) {
+    std::vector<size_t> offsets(1, 0);
+    for (size_t i = 0; i < neurons.size(); i++) {
+        int next = (i + 1 < neurons.size()) ? neurons[i + 1] : 0;
+        offsets.push_back(offsets.back() + NN_Matrix::view_size(1, neurons[i], false));
+        offsets.push_back(offsets.back() + NN_Matrix::view_size(next > 0 ? neurons[i] : 0, next, true));
+    }
+    return offsets;
+}
+
+size_t NN::param_count(const std::vector<int>& neurons) {
+    return _param_offsets(neurons).back();
+}
+
+void NN::_bind_params() {
+    const std::vector<size_t> offsets = _param_offsets();
+    std::vector<NN_Matrix> old(2 * layers.size());
+    for (size_t i = 0; i < layers.size(); i++) {
+        old[2 * i] = std::move(layers[i].biased);
+        old[2 * i + 1] = std::move(layers[i].weights);
+        assert(old[2 * i + 1].stride() == (int) nn_align_up(old[2 * i + 1].cols(), NN_ALIGN_FLOATS));
+    }
+
+    // Every part is zeroed by its view, the large weights by the threads of
+    // their column shards (see NN_Matrix::init_padded()).
+    NN_Matrix arena;
+    arena.init_zero(1, (int) offsets.back(), [&](matrix_t* data, size_t) {
+        for (size_t i = 0; i < layers.size(); i++) {
+            layers[i].biased.view(data + offsets[2 * i], 1, old[2 * i].cols(), false);
+            layers[i].weights.view(data + offsets[2 * i + 1], old[2 * i + 1].rows(), old[2 * i + 1].cols(), true);
+        }
+    });
+    for (size_t i = 0; i < layers.size(); i++) {
+        layers[i].biased = old[2 * i];
+        layers[i].weights = old[2 * i + 1];
+    }
+    params = std::move(arena);
+}
+
+void NN::bind_gradients(NN_Workspace& ws) const {
+    const std::vector<size_t> offsets = _param_offsets();
+    ws.grad_weights.resize(layers.size() - 1);
+    ws.grad_biased.resize(layers.size());
+    ws.grad_params.init_zero(1, (int) offsets.back(), [&](matrix_t* data, size_t) {
+        for (size_t i = 0; i < layers.size(); i++) {
+            ws.grad_biased[i].view(data + offsets[2 * i], 1, layers[i].biased.cols(), false);
+            if (i + 1 == layers.size()) break;
+            const NN_Matrix& w = layers[i].weights;
+            ws.grad_weights[i].view(data + offsets[2 * i + 1], w.rows(), w.cols(), true);
+        }
+    });
+}
+
+bool NN::_gradients_bound(const NN_Workspace& ws) const {
+    return ws.grad_biased.size() == layers.size() && ws.grad_params.cols() == params.cols() &&
+        ws.grad_biased[0].data().data() == ws.grad_params.data().data();
+}
+
+template <class Outputs>
+void NN::_backprop(const NN_Matrix& expected, Outputs outputs, NN_Matrix& delta, NN_Matrix& delta_next,
+                   NN_Workspace* grads) {
+    NN_Matrix& output = outputs(layers.size() - 1);
     assert(expected.rows() == output.rows() && expected.cols() == output.cols());
 
+    // The gradients are summed over the batch by the gemm (and the row
+    // sums), scaling the step by 1/B makes it their average.
+    const matrix_t step = -learn_rate / output.rows();
+
   // delta_out = out - exp
   // delta_hidden = w.trans() * next_delta x (a * (1-a))
   //
-  // curr_b += -learn_rate * curr_delta
-  // prev_w += -learn_rate * (curr_delta.trans() * prev_active)
+  // curr_b += -learn_rate * mean(curr_delta)
+  // prev_w += -learn_rate * (prev_active.trans() * curr_delta) / B
 
-    NN_Matrix delta = output - expected;
+    delta = output - expected;
     for (size_t i = layers.size() - 1; i > 0; i--) {
         Layer& curr = layers[i];
         Layer& prev = layers[i - 1];
+        const NN_Matrix& prev_outputs = outputs(i - 1);
+
+        if (grads != nullptr) {
+            grads->grad_biased[i].init(1, curr.biased.cols());
+            grads->grad_biased[i].add_row_sums(delta, 1);
+            grads->grad_weights[i - 1].gemm(prev_outputs, true, delta, false);
+        } else {
+            curr.biased.add_row_sums(delta, step);
+
+            // prev_w += step * (prev_a.trans() * delta), the transpose is
+            // only a flag to the gemm.
+            prev.weights.gemm(prev_outputs, true, delta, false, step, 1);
+        }
 
-        curr.biased += (delta * (-learn_rate));
-        prev.weights += (prev.outputs.transpose() * delta) * (-learn_rate);
-
-        // sigmoid_derivative = (a * (1 - a));
-        NN_Matrix one = NN_Matrix(prev.outputs.rows(), prev.outputs.cols(), 1);
-        NN_Matrix sigmoid_derivative = prev.outputs.multiply(one - prev.outputs);
+        // The input layer has nothing to update with its delta.
+        if (i == 1) break;
 
         // delta_next = (delta * prev.w.trans()) x (a * (1-a));
-        delta = (delta * prev.weights.transpose()).multiply_inplace(sigmoid_derivative);
+        delta_next.gemm(delta, false, prev.weights, true);
+        delta_next = delta_next.multiply(prev_outputs.multiply(1.f - prev_outputs));
+        std::swap(delta, delta_next);
     }
 }
 
+void NN::copy_to(NN& dst) const {
+    dst.learn_rate = learn_rate;
+    dst.sigmoid_mode = sigmoid_mode;
+    dst.trained = trained;
+    dst.data_index = data_index;
+    dst.output_labels = output_labels;
+
+    // Laid out the same, the parameters are a single copy.
+    bool same = dst.layers.size() == layers.size() && dst.params.cols() == params.cols() &&
+        !layers.empty() && dst.layers[0].biased.data().data() == dst.params.data().data();
+    for (size_t i = 0; same && i < layers.size(); i++) {
+        same = dst.layers[i].biased.cols() == layers[i].biased.cols() &&
+            dst.layers[i].weights.rows() == layers[i].weights.rows() &&
+            dst.layers[i].weights.cols() == layers[i].weights.cols();
+    }
+    if (!same) {
+        dst.layers.clear();
+        dst.layers.resize(layers.size());
+    }
+
+    for (size_t i = 0; i < layers.size(); i++) {
+        dst.layers[i].outputs = layers[i].outputs;
+        if (same) continue;
+        dst.layers[i].biased = layers[i].biased;
+        dst.layers[i].weights = layers[i].weights;
+    }
+    if (same) dst.params = params;
+    else dst._bind_params();
+}
+
+std::vector<int> NN::saved_layers(const char* path) {
+  std::vector<int> neurons;
+  std::ifstream file(path, std::ios::binary);
+  int magic = 0, value = 0, layer_count = 0;
+  file.read((char*)&magic, sizeof magic);
+  // trained, which the old files start with, then data_index.
+  if (magic == NN_FILE_MAGIC) file.read((char*)&value, sizeof value);
+  file.read((char*)&value, sizeof value);
+  file.read((char*)&layer_count, sizeof layer_count);
+
+  for (int i = 0; file && i < layer_count; i++) {
+    if (magic == NN_FILE_MAGIC) {
+      file.read((char*)&value, sizeof value);
+      neurons.push_back(value);
+      continue;
+    }
+    // The biases then the weights, each its rows, its cols and the values.
+    for (int m = 0; m < 2; m++) {
+      int rows = 0, cols = 0;
+      file.read((char*)&rows, sizeof rows);
+      file.read((char*)&cols, sizeof cols);
+      if (m == 0) neurons.push_back(cols);
+      file.seekg((std::streamoff) rows * cols * sizeof(matrix_t), std::ios::cur);
+    }
+  }
+  if (!file) neurons.clear();
+  return neurons;
+}
+
+// The magic number, trained, data_index, the layer count, the neurons of
+// every layer, the size of params and params as it is in memory, padding
+// included, in one write.
 void NN::save(const char* path) const {
 
   std::ofstream file(path, std::ios::binary);
   assert(!!file);
 
+  int magic = NN_FILE_MAGIC;
+  file.write((const char*)(&magic), sizeof magic);
   file.write((const char*)(&trained), sizeof trained);
   file.write((const char*)(&data_index), sizeof data_index);
 
   int layer_count = (int) layers.size();
   file.write((const char*)(&layer_count), sizeof layer_count);
-
   for (const Layer& layer : layers) {
-    int activation_count = (int) layer.outputs.cols();
-
-    assert(
-      layer.outputs.rows() == 1 &&
-      layer.biased.rows() == 1 &&
-      activation_count == layer.biased.cols()
-    );
-
-    write_matrix(file, layer.biased);
-    write_matrix(file, layer.weights);
+    int neurons = layer.outputs.cols();
+    file.write((const char*)(&neurons), sizeof neurons);
   }
 
+  long long count = (long long) params.data().size();
+  file.write((const char*)(&count), sizeof count);
+  file.write((const char*) params.data().data(), count * sizeof(matrix_t));
+
   file.close();
 }
 
@@ -165,7 +422,36 @@ void NN::load(const char* path) {
   std::ifstream file(path, std::ios::binary);
   assert(!!file && "Cannot open the nn file.");
 
-  file.read((char*)(&trained), sizeof trained);
+  int magic;
+  file.read((char*)(&magic), sizeof magic);
+  if (magic == NN_FILE_MAGIC) {
+    file.read((char*)(&trained), sizeof trained);
+    file.read((char*)(&data_index), sizeof data_index);
+
+    int layer_count;
+    file.read((char*)&layer_count, sizeof layer_count);
+    assert(layer_count >= 1);
+
+    for (int i = 0; i < layer_count; i++) {
+      int neurons;
+      file.read((char*)&neurons, sizeof neurons);
+      assert(neurons >= 0);
+      if (i == 0) layers.push_back(Layer(neurons));
+      else layers.push_back(layers.back().next_layer(neurons));
+    }
+    _bind_params();
+
+    // Saved with another NN_ALIGN the layout wouldn't match.
+    long long count;
+    file.read((char*)&count, sizeof count);
+    assert(count == (long long) params.data().size());
+    file.read((char*) params.data().data(), count * sizeof(matrix_t));
+    assert(!!file);
+    return;
+  }
+
+  // An old file, trained came first, then a matrix after the other.
+  trained = magic;
   file.read((char*)(&data_index), sizeof data_index);
 
   int layer_count;
@@ -180,7 +466,7 @@ void NN::load(const char* path) {
     assert(l.biased.rows() == 1);
 
     l.outputs.init(1, l.biased.cols());
-    l.weights = read_matrix(file);
+    l.weights = read_matrix(file, true);
 
     layers.push_back(std::move(l));
   }
@@ -193,6 +479,7 @@ void NN::load(const char* path) {
     assert(curr.weights.cols() == next.outputs.cols());
   }
 
+  _bind_params();
 }
 
 
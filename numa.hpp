@@ -0,0 +1,238 @@
+#pragma once
+
+#ifndef NUMA_HPP_INCLUDED
+#define NUMA_HPP_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+#if defined(__linux__)
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
+// The NUMA nodes of the machine and where memory is, for a box with more
+// than one socket: the topology and the counters are read from /sys, the
+// pages are moved and looked up with the mbind / move_pages system calls,
+// no libnuma needed. Elsewhere (or without /sys) there is a single node with
+// every CPU, and nothing moves.
+
+namespace numa {
+
+struct Node {
+  int id;                // As the kernel numbers it.
+  std::vector<int> cpus;
+};
+
+// The nodes with CPUs, by id.
+struct Topology {
+  std::vector<Node> nodes;
+  std::vector<int> node_of_cpu; // Index in nodes, by CPU.
+
+  int count() const { return (int) nodes.size(); }
+};
+
+const Topology& topology();
+
+// Index in topology().nodes of the node the calling thread runs on.
+int current_node();
+
+// Puts the whole pages of [data, data + bytes) on node (an index in
+// topology().nodes), moving those which are already somewhere else. False if
+// they can't be, or not on Linux.
+bool bind(const void* data, size_t bytes, int node);
+
+// The pages of [data, data + bytes) which are on each node, by index in
+// topology().nodes. Pages not touched yet aren't counted.
+std::vector<size_t> pages_per_node(const void* data, size_t bytes);
+
+// The counters of /sys/devices/system/node/node*/numastat, in pages since
+// boot. local + other are the pages allocated by the node's CPUs, other the
+// ones which had to come from another node; miss is the pages the node gave
+// when another was asked for.
+struct Stats {
+  long long hit = 0, miss = 0, foreign = 0, local = 0, other = 0;
+};
+
+// By index in topology().nodes.
+std::vector<Stats> stats();
+
+// "0-3,8-11" to { 0, 1, 2, 3, 8, 9, 10, 11 }.
+static inline std::vector<int> _parse_list(const char* list) {
+  std::vector<int> values;
+  const char* p = list;
+  while (*p) {
+    char* end;
+    long first = strtol(p, &end, 10);
+    if (end == p) break;
+    long last = first;
+    if (*end == '-') {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+      if (end == p) break;
+    }
+    for (long v = first; v <= last; v++) values.push_back((int) v);
+    p = (*end == ',') ? end + 1 : end;
+  }
+  return values;
+}
+
+// The first line of a small /sys file, empty if there is none.
+static inline std::string _read_line(const char* path) {
+  std::string line;
+  FILE* file = fopen(path, "r");
+  if (file == NULL) return line;
+  char buff[4096];
+  if (fgets(buff, sizeof buff, file) != NULL) line = buff;
+  fclose(file);
+  while (!line.empty() && (line.back() == '\n' || line.back() == ' ')) line.pop_back();
+  return line;
+}
+
+static inline Topology _read_topology() {
+  Topology topo;
+  std::string online = _read_line("/sys/devices/system/node/online");
+  for (int id : _parse_list(online.c_str())) {
+    char path[128];
+    snprintf(path, sizeof path, "/sys/devices/system/node/node%d/cpulist", id);
+    Node node;
+    node.id = id;
+    node.cpus = _parse_list(_read_line(path).c_str());
+    // A node of memory only has nothing to run threads on.
+    if (!node.cpus.empty()) topo.nodes.push_back(node);
+  }
+
+  if (topo.nodes.empty()) {
+    Node node;
+    node.id = 0;
+    int cpus = (int) std::thread::hardware_concurrency();
+    for (int c = 0; c < (cpus > 0 ? cpus : 1); c++) node.cpus.push_back(c);
+    topo.nodes.push_back(node);
+  }
+
+  for (int n = 0; n < topo.count(); n++) {
+    for (int cpu : topo.nodes[n].cpus) {
+      if (cpu >= (int) topo.node_of_cpu.size()) topo.node_of_cpu.resize(cpu + 1, 0);
+      topo.node_of_cpu[cpu] = n;
+    }
+  }
+  return topo;
+}
+
+inline const Topology& topology() {
+  static Topology topo = _read_topology();
+  return topo;
+}
+
+inline int current_node() {
+#if defined(__linux__)
+  const Topology& topo = topology();
+  int cpu = sched_getcpu();
+  if (cpu >= 0 && cpu < (int) topo.node_of_cpu.size()) return topo.node_of_cpu[cpu];
+#endif
+  return 0;
+}
+
+#if defined(__linux__)
+// The whole pages inside [data, data + bytes).
+static inline bool _page_range(const void* data, size_t bytes, uintptr_t& begin, size_t& length) {
+  uintptr_t page = (uintptr_t) sysconf(_SC_PAGESIZE);
+  begin = ((uintptr_t) data + page - 1) / page * page;
+  uintptr_t end = ((uintptr_t) data + bytes) / page * page;
+  length = (end > begin) ? end - begin : 0;
+  return length > 0;
+}
+#endif
+
+inline bool bind(const void* data, size_t bytes, int node) {
+#if defined(__linux__)
+  const Topology& topo = topology();
+  if (node < 0 || node >= topo.count()) return false;
+  uintptr_t begin;
+  size_t length;
+  if (!_page_range(data, bytes, begin, length)) return true;
+
+  const int id = topo.nodes[node].id;
+  const unsigned long bits = 8 * sizeof(unsigned long);
+  std::vector<unsigned long> mask(id / bits + 1, 0);
+  mask[id / bits] |= 1UL << (id % bits);
+  return syscall(SYS_mbind, begin, length, MPOL_BIND, mask.data(), mask.size() * bits + 1, MPOL_MF_MOVE) == 0;
+#else
+  (void) data;
+  (void) bytes;
+  (void) node;
+  return false;
+#endif
+}
+
+inline std::vector<size_t> pages_per_node(const void* data, size_t bytes) {
+  const Topology& topo = topology();
+  std::vector<size_t> pages(topo.count(), 0);
+#if defined(__linux__)
+  uintptr_t begin;
+  size_t length;
+  if (!_page_range(data, bytes, begin, length)) return pages;
+
+  // By node id, then to the index.
+  std::vector<int> index_of_id;
+  for (int n = 0; n < topo.count(); n++) {
+    int id = topo.nodes[n].id;
+    if (id >= (int) index_of_id.size()) index_of_id.resize(id + 1, -1);
+    index_of_id[id] = n;
+  }
+
+  // move_pages() without target nodes only says where they are.
+  const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+  const size_t count = length / page;
+  const size_t chunk = 1024;
+  std::vector<void*> addresses(chunk);
+  std::vector<int> status(chunk);
+  for (size_t first = 0; first < count; first += chunk) {
+    size_t n = (count - first < chunk) ? count - first : chunk;
+    for (size_t i = 0; i < n; i++) addresses[i] = (void*)(begin + (first + i) * page);
+    if (syscall(SYS_move_pages, 0, n, addresses.data(), NULL, status.data(), 0) != 0) break;
+    for (size_t i = 0; i < n; i++) {
+      int id = status[i];
+      if (id >= 0 && id < (int) index_of_id.size() && index_of_id[id] >= 0) pages[index_of_id[id]]++;
+    }
+  }
+#else
+  (void) data;
+  (void) bytes;
+#endif
+  return pages;
+}
+
+inline std::vector<Stats> stats() {
+  const Topology& topo = topology();
+  std::vector<Stats> all(topo.count());
+  for (int n = 0; n < topo.count(); n++) {
+    char path[128];
+    snprintf(path, sizeof path, "/sys/devices/system/node/node%d/numastat", topo.nodes[n].id);
+    FILE* file = fopen(path, "r");
+    if (file == NULL) continue;
+
+    char name[64];
+    long long value;
+    while (fscanf(file, "%63s %lld", name, &value) == 2) {
+      if (strcmp(name, "numa_hit") == 0) all[n].hit = value;
+      else if (strcmp(name, "numa_miss") == 0) all[n].miss = value;
+      else if (strcmp(name, "numa_foreign") == 0) all[n].foreign = value;
+      else if (strcmp(name, "local_node") == 0) all[n].local = value;
+      else if (strcmp(name, "other_node") == 0) all[n].other = value;
+    }
+    fclose(file);
+  }
+  return all;
+}
+
+} // namespace numa
+
+#endif // NUMA_HPP_INCLUDED
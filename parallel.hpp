@@ -0,0 +1,489 @@
+#pragma once
+
+#ifndef PARALLEL_HPP_INCLUDED
+#define PARALLEL_HPP_INCLUDED
+
+#include <stdlib.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#if defined(__unix__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "numa.hpp"
+
+// The one pool of worker threads every parallel loop of the project runs on:
+// the gemm and gemv, the large element-wise ops, the batches of a dataset,
+// the evaluation, the Hogwild and data parallel training. A loop inside a
+// loop goes to the same threads instead of starting its own, so the machine
+// is never oversubscribed.
+//
+// It steals work: every thread has a deque of jobs, pushes the jobs it makes
+// to its own and takes them back from the same end (the newest, still in its
+// cache), while an idle thread steals from the other end of someone else's
+// (the oldest, the largest pieces of a loop). A parallel_for starts as one
+// job over the whole range, which pushes half of itself and keeps the other
+// half, down to the grain. A thread waiting for jobs to be done works on any
+// job meanwhile, so a nested loop doesn't block a thread, and the threads
+// which aren't workers (main, the GUI's training thread) help while they
+// wait.
+//
+// The threads are started the first time they are needed and sleep on a
+// condition variable while there is nothing to do. The NN_THREADS
+// environment variable sets their number (including the calling one), by
+// default it's the number of hardware threads, and NN_PIN=1 pins worker i to
+// core i (on Linux). See configure() to set them from the code.
+//
+// NN_NUMA=1 is for a machine of several NUMA nodes: the threads are split in
+// contiguous blocks, one per node, each kept on the cores of its node (on
+// one core of it with NN_PIN too), the thread which makes the pool going with
+// index 0 on the first node. What a thread touches first then lands on its
+// node, so the buffers which stay with an index of run_each() (the gemm's
+// column shards, the replicas of DataParallel, the workers of Hogwild) are
+// local to the thread working on them.
+
+// Jobs a deque holds, a thread which finds its own full runs the job itself.
+#define NN_POOL_DEQUE 256
+
+namespace parallel {
+
+typedef void (*Task)(void* ctx, int begin, int end);
+
+struct Config {
+  int threads = 0;  // Including the calling one, 0 for NN_THREADS.
+  bool pin = false;  // Worker i on core i, or NN_PIN.
+  bool numa = false; // Threads kept on the NUMA nodes, or NN_NUMA.
+};
+
+// How the pool is made, call it before anything runs on it (it's too late
+// afterwards, then it returns false).
+bool configure(const Config& config);
+
+class Pool {
+public:
+  static Pool& instance();
+
+  // Threads working on the jobs, the caller included.
+  int size() const { return _size; }
+
+  // The NUMA nodes the threads are spread over (1 unless NN_NUMA), and the
+  // one of thread index (as in run_each()), an index in numa::topology().
+  int nodes() const { return _nodes; }
+  int node(int index) const { return (int)((long long) index * _nodes / _size); }
+
+  // Runs task over [begin, end) in chunks of at most grain, on the workers
+  // and the calling thread, and returns once every chunk is done. Fine to
+  // call from a task, the chunks go to whichever threads are free.
+  void run(int begin, int end, int grain, Task task, void* ctx);
+
+  // Runs task(ctx, index, size()) once per thread, index 0 being the calling
+  // thread and worker i always getting index i, so the same index lands on
+  // the same thread from one call to the next (for data which should stay
+  // with a thread, see gemm::shard_cols). From a task, or while another
+  // thread is in a run_each(), the indices are a run() instead, on any
+  // thread.
+  void run_each(Task task, void* ctx);
+
+  ~Pool();
+
+private:
+  friend class TaskGroup;
+
+  struct Job {
+    Task task;
+    void* ctx;
+    int begin, end, grain;
+    std::atomic<int>* pending; // Of the loop or group, one less once done.
+  };
+
+  struct alignas(64) Deque {
+    std::mutex mutex;
+    Job jobs[NN_POOL_DEQUE];
+    unsigned head = 0; // Stolen from.
+    unsigned tail = 0; // Pushed to and popped by the owner.
+  };
+
+  explicit Pool(const Config& config);
+
+  void _worker(int index);
+  bool _push(const Job& job);
+  bool _take(Job& job);
+  void _execute(Job job);
+  void _each(int index);
+  void _help(std::atomic<int>& pending);
+  void _submit(std::atomic<int>& pending, std::function<void()>* fn);
+  void _wake_all();
+  bool _serial() const;
+  std::vector<int> _cpus(int index) const;
+
+  const int _size; // Set before the workers start, which read them.
+  int _nodes = 1;
+  bool _pin;
+  bool _numa;
+  std::vector<std::thread> _threads;
+
+  // [0] is shared by the threads which aren't workers, [i] is worker i's.
+  std::unique_ptr<Deque[]> _deques;
+  std::atomic<int> _queued{0};
+
+  std::mutex _sleep;
+  std::condition_variable _wake;
+  std::atomic<int> _sleeping{0};
+  std::atomic<bool> _stop{false};
+
+  // The run_each() in progress, _each_todo[i] is set until worker i ran its
+  // index.
+  std::mutex _each_busy;
+  Task _each_task = nullptr;
+  void* _each_ctx = nullptr;
+  std::unique_ptr<std::atomic<bool>[]> _each_todo;
+  std::atomic<int> _each_pending{0};
+};
+
+// Jobs of any kind on the pool, wait() returns once all of them are done and
+// works on them (or anything else queued) meanwhile. A job may run on the
+// thread which calls run() or wait(), so they shouldn't wait for each other.
+class TaskGroup {
+public:
+  TaskGroup() {}
+  ~TaskGroup() { wait(); }
+
+  TaskGroup(const TaskGroup&) = delete;
+  TaskGroup& operator=(const TaskGroup&) = delete;
+
+  template <class F> void run(F&& fn);
+  void wait();
+
+private:
+  std::atomic<int> _pending{0};
+};
+
+// The deque of the thread, 0 for those which aren't workers.
+static inline int& _self() {
+  static thread_local int self = 0;
+  return self;
+}
+
+// Jobs the thread is in the middle of.
+static inline int& _depth() {
+  static thread_local int depth = 0;
+  return depth;
+}
+
+static inline Config& _config() {
+  static Config config;
+  return config;
+}
+
+static inline std::atomic<bool>& _created() {
+  static std::atomic<bool> created{false};
+  return created;
+}
+
+// The threads don't survive a fork(), a child process runs everything
+// serially.
+static inline std::atomic<bool>& _forked() {
+  static std::atomic<bool> forked{false};
+  return forked;
+}
+
+inline bool configure(const Config& config) {
+  if (_created()) return false;
+  _config() = config;
+  return true;
+}
+
+static inline Config _resolve_config() {
+  Config config = _config();
+  if (config.threads <= 0) {
+    const char* env = getenv("NN_THREADS");
+    config.threads = (env != NULL) ? atoi(env) : 0;
+  }
+  if (config.threads <= 0) config.threads = (int) std::thread::hardware_concurrency();
+  if (config.threads <= 0) config.threads = 1;
+
+  const char* pin = getenv("NN_PIN");
+  if (pin != NULL && atoi(pin) != 0) config.pin = true;
+  const char* numa = getenv("NN_NUMA");
+  if (numa != NULL && atoi(numa) != 0) config.numa = true;
+  return config;
+}
+
+// Keeps the calling thread on cpus.
+static inline void _pin_thread(const std::vector<int>& cpus) {
+#if defined(__linux__)
+  if (cpus.empty()) return;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus) {
+    if (cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+  }
+  // Not being allowed on those cores isn't worth failing for.
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+  (void) cpus;
+#endif
+}
+
+inline Pool& Pool::instance() {
+  static Pool pool((_created() = true, _resolve_config()));
+  return pool;
+}
+
+inline Pool::Pool(const Config& config)
+  : _size(config.threads), _pin(config.pin), _numa(config.numa),
+    _deques(new Deque[config.threads]), _each_todo(new std::atomic<bool>[config.threads]) {
+  for (int i = 0; i < config.threads; i++) _each_todo[i] = false;
+#if defined(__unix__)
+  pthread_atfork(nullptr, nullptr, [] { _forked() = true; });
+#endif
+  if (_numa) {
+    int count = numa::topology().count();
+    _nodes = (count < _size) ? count : _size;
+    _pin_thread(_cpus(0));
+  }
+  for (int i = 1; i < config.threads; i++) {
+    _threads.emplace_back(&Pool::_worker, this, i);
+  }
+}
+
+inline Pool::~Pool() {
+  // A forked child has the handles of the parent's workers but not the
+  // threads, nor maybe the locks they held at the fork: nothing to stop.
+  if (_forked()) {
+    for (std::thread& t : _threads) t.detach();
+    return;
+  }
+  _stop = true;
+  _wake_all();
+  for (std::thread& t : _threads) t.join();
+}
+
+// The cores thread index may run on, none for anywhere.
+inline std::vector<int> Pool::_cpus(int index) const {
+  std::vector<int> cpus;
+  if (_numa) {
+    const std::vector<int>& node_cpus = numa::topology().nodes[node(index)].cpus;
+    if (!_pin) return node_cpus;
+    // Its rank among the threads of its node.
+    int first = index;
+    while (first > 0 && node(first - 1) == node(index)) first--;
+    cpus.push_back(node_cpus[(index - first) % node_cpus.size()]);
+  } else if (_pin) {
+    int cores = (int) std::thread::hardware_concurrency();
+    cpus.push_back(index % (cores > 0 ? cores : 1));
+  }
+  return cpus;
+}
+
+inline bool Pool::_serial() const {
+  return _size == 1 || _forked();
+}
+
+inline void Pool::_wake_all() {
+  { std::lock_guard<std::mutex> lock(_sleep); }
+  _wake.notify_all();
+}
+
+inline bool Pool::_push(const Job& job) {
+  Deque& d = _deques[_self()];
+  {
+    std::lock_guard<std::mutex> lock(d.mutex);
+    if (d.tail - d.head == NN_POOL_DEQUE) return false;
+    d.jobs[d.tail++ % NN_POOL_DEQUE] = job;
+    _queued++;
+  }
+  // A worker about to sleep has either counted itself in _sleeping, or will
+  // see _queued under the lock.
+  if (_sleeping > 0) {
+    { std::lock_guard<std::mutex> lock(_sleep); }
+    _wake.notify_one();
+  }
+  return true;
+}
+
+// The newest job of the own deque, or else the oldest of another one.
+inline bool Pool::_take(Job& job) {
+  const int self = _self();
+  const int count = size();
+  for (int k = 0; k < count; k++) {
+    Deque& d = _deques[(self + k) % count];
+    std::lock_guard<std::mutex> lock(d.mutex);
+    if (d.tail == d.head) continue;
+    job = (k == 0) ? d.jobs[--d.tail % NN_POOL_DEQUE] : d.jobs[d.head++ % NN_POOL_DEQUE];
+    _queued--;
+    return true;
+  }
+  return false;
+}
+
+// Halves the range down to the grain, the upper halves going to the deque
+// for others to steal, then runs what is left.
+inline void Pool::_execute(Job job) {
+  _depth()++;
+  while (job.end - job.begin > job.grain) {
+    int chunks = (job.end - job.begin + job.grain - 1) / job.grain;
+    Job half = job;
+    half.begin = job.begin + chunks / 2 * job.grain;
+    job.pending->fetch_add(1);
+    if (!_push(half)) {
+      job.pending->fetch_sub(1);
+      break;
+    }
+    job.end = half.begin;
+  }
+  for (int b = job.begin; b < job.end; b += job.grain) {
+    job.task(job.ctx, b, (job.end - b < job.grain) ? job.end : b + job.grain);
+  }
+  _depth()--;
+  job.pending->fetch_sub(1, std::memory_order_release);
+}
+
+// Its index of the run_each() in progress, if it's still to do.
+inline void Pool::_each(int index) {
+  if (index == 0 || !_each_todo[index].load(std::memory_order_acquire)) return;
+  if (!_each_todo[index].exchange(false)) return;
+  _depth()++;
+  _each_task(_each_ctx, index, size());
+  _depth()--;
+  _each_pending.fetch_sub(1, std::memory_order_release);
+}
+
+// Works on whatever there is until pending drops to 0. Spins first, what
+// it waits for is usually about to be done, then yields, then sleeps a bit
+// if it's taking long (or there are more threads than cores).
+inline void Pool::_help(std::atomic<int>& pending) {
+  int spins = 0;
+  while (pending.load(std::memory_order_acquire) > 0) {
+    _each(_self());
+    Job job;
+    if (_take(job)) {
+      _execute(job);
+      spins = 0;
+      continue;
+    }
+    spins++;
+    if (spins < 64) continue;
+    if (spins < 128) std::this_thread::yield();
+    else std::this_thread::sleep_for(std::chrono::microseconds(20));
+  }
+}
+
+inline void Pool::_worker(int index) {
+  _self() = index;
+  _pin_thread(_cpus(index));
+
+  int idle = 0;
+  for (;;) {
+    _each(index);
+    Job job;
+    if (_take(job)) {
+      _execute(job);
+      idle = 0;
+      continue;
+    }
+    if (++idle < 64) {
+      std::this_thread::yield();
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(_sleep);
+    _sleeping++;
+    _wake.wait(lock, [&] { return _stop || _queued > 0 || _each_todo[index]; });
+    _sleeping--;
+    if (_stop) return;
+    idle = 0;
+  }
+}
+
+inline void Pool::run(int begin, int end, int grain, Task task, void* ctx) {
+  if (grain < 1) grain = 1;
+  if (end - begin <= grain || _serial()) {
+    for (int b = begin; b < end; b += grain) task(ctx, b, (end - b < grain) ? end : b + grain);
+    return;
+  }
+
+  std::atomic<int> pending{1};
+  _execute(Job{ task, ctx, begin, end, grain, &pending });
+  _help(pending);
+}
+
+inline void Pool::run_each(Task task, void* ctx) {
+  if (_serial()) {
+    for (int i = 0; i < size(); i++) task(ctx, i, size());
+    return;
+  }
+  std::unique_lock<std::mutex> busy(_each_busy, std::defer_lock);
+  if (_depth() > 0 || !busy.try_lock()) {
+    // The task still wants (index, size()) from the (begin, end) of run().
+    struct Each { Task task; void* ctx; int count; } each = { task, ctx, size() };
+    run(0, size(), 1, [](void* ctx, int begin, int end) {
+      Each* each = (Each*) ctx;
+      for (int i = begin; i < end; i++) each->task(each->ctx, i, each->count);
+    }, &each);
+    return;
+  }
+
+  _each_task = task;
+  _each_ctx = ctx;
+  _each_pending = size() - 1;
+  for (int i = 1; i < size(); i++) _each_todo[i].store(true, std::memory_order_release);
+  _wake_all();
+
+  _depth()++;
+  task(ctx, 0, size());
+  _depth()--;
+  _help(_each_pending);
+}
+
+inline void Pool::_submit(std::atomic<int>& pending, std::function<void()>* fn) {
+  Task call = [](void* ctx, int, int) {
+    std::function<void()>* fn = (std::function<void()>*) ctx;
+    (*fn)();
+    delete fn;
+  };
+  Job job{ call, fn, 0, 1, 1, &pending };
+
+  pending++;
+  if (_serial() || !_push(job)) _execute(job);
+}
+
+template <class F>
+void TaskGroup::run(F&& fn) {
+  Pool::instance()._submit(_pending, new std::function<void()>(std::forward<F>(fn)));
+}
+
+inline void TaskGroup::wait() {
+  if (_pending > 0) Pool::instance()._help(_pending);
+}
+
+// fn(chunk_begin, chunk_end) for every grain sized chunk of [begin, end).
+template <class F>
+static void parallel_for(int begin, int end, int grain, F&& fn) {
+  typedef typename std::remove_reference<F>::type Fn;
+  Pool::instance().run(begin, end, grain, [](void* ctx, int b, int e) {
+    (*(Fn*) ctx)(b, e);
+  }, (void*) &fn);
+}
+
+// fn(index, count) once per thread of the pool, see Pool::run_each().
+template <class F>
+static void parallel_each(F&& fn) {
+  typedef typename std::remove_reference<F>::type Fn;
+  Pool::instance().run_each([](void* ctx, int index, int count) {
+    (*(Fn*) ctx)(index, count);
+  }, (void*) &fn);
+}
+
+} // namespace parallel
+
+#endif // PARALLEL_HPP_INCLUDED
@@ -0,0 +1,291 @@
+#pragma once
+
+#ifndef PIPELINE_HPP_INCLUDED
+#define PIPELINE_HPP_INCLUDED
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <string.h>
+
+#include "nn.hpp"
+#include "dataset.hpp"
+#include "loader.hpp"
+#include "spsc_queue.hpp"
+
+// Pipeline parallel training in the way of GPipe: the layers are split in
+// contiguous stages, each with its own thread, and a batch in micro-batches
+// which stream through the stages forward, then back. Stage s hands the id
+// of a micro-batch to stage s + 1 once its activations are ready, and
+// stage s + 1 hands it back once the delta of stage s's last layer is, over
+// bounded SPSC queues. While stage s works on micro-batch m the others work
+// on their own, so every core is busy even when no single gemm is worth
+// splitting.
+//
+// The stages have threads of their own rather than being jobs of the
+// parallel::Pool: a stage waits on its queues for the whole batch, and stages
+// waiting for each other as jobs could take every thread of the pool with
+// none left to run the one they wait for. Their gemms still go to the pool.
+//
+// The gradients are summed over the micro-batches and applied once the whole
+// batch went through, so the weights don't change during a batch and a step
+// is the one of NN::compute_gradients() / apply_gradients() on the batch.
+class Pipeline {
+public:
+  // stages is capped at the number of layers with weights before them.
+  Pipeline(NN& nn, int stages, int micro_batches);
+  ~Pipeline();
+
+  int stages() const;
+
+  // One step on the rows of inputs, returns the summed cost.
+  double train_batch(const NN_Matrix& inputs, const NN_Matrix& expected);
+
+  // Mean squared error of the epoch, order is the samples in the order they
+  // are batched.
+  float train_epoch(const Dataset& dataset, const std::vector<int>& order, int batch);
+  // The same with the batches of loader, gathered while the previous trains.
+  float train_epoch(BatchLoader& loader, const std::vector<int>& order, int batch);
+
+private:
+  struct Stage {
+    int first = 0; // Computes the outputs of the layers [first, last).
+    int last = 0;
+    double cost = 0; // Of the last stage.
+  };
+
+  void _worker(int stage);
+  void _run(int stage);
+  void _forward(int stage, int micro);
+  void _backward(int stage, int micro);
+
+  NN& nn;
+  int micro_batches;
+  std::vector<Stage> stage_layers;
+
+  // activations[m][i] and deltas[m][i] are those of layer i for micro-batch
+  // m. An activation is written by the stage of layer i (the inputs by
+  // stage 0), a delta by the stage of layer i + 1 (the last by the last).
+  std::vector<std::vector<NN_Matrix>> activations;
+  std::vector<std::vector<NN_Matrix>> deltas;
+  std::vector<NN_Matrix> expected_rows;
+  NN_Workspace grads;
+
+  // forward[s] goes from stage s to s + 1, backward[s] from s + 1 to s.
+  std::vector<SpscQueue<int>> forward;
+  std::vector<SpscQueue<int>> backward;
+
+  // The batch of the current step.
+  const NN_Matrix* inputs = nullptr;
+  const NN_Matrix* expected = nullptr;
+
+  std::vector<std::thread> threads; // For the stages after the first.
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable done;
+  unsigned generation = 0;
+  int pending = 0;
+  bool stop = false;
+};
+
+Pipeline::Pipeline(NN& nn, int stages, int micro_batches)
+  : nn(nn), micro_batches(micro_batches > 0 ? micro_batches : 1) {
+  assert(nn.layers.size() >= 2);
+  int layers = (int) nn.layers.size();
+  int count = std::max(1, std::min(stages, layers - 1));
+
+  // Contiguous ranges of about the same number of multiply-adds, layer i
+  // costing outputs(i - 1) * outputs(i) of them.
+  double total = 0;
+  for (int i = 1; i < layers; i++) total += (double) nn.layers[i - 1].outputs.cols() * nn.layers[i].outputs.cols();
+
+  double sum = 0;
+  int first = 1;
+  for (int s = 0; s < count; s++) {
+    Stage stage;
+    stage.first = first;
+    int last = first + 1;
+    sum += (double) nn.layers[first - 1].outputs.cols() * nn.layers[first].outputs.cols();
+    // Take more layers while it's not past its share, and while every later
+    // stage still has a layer.
+    while (last < layers - (count - s - 1)) {
+      double next = (double) nn.layers[last - 1].outputs.cols() * nn.layers[last].outputs.cols();
+      if (s + 1 < count && sum + next / 2 > total * (s + 1) / count) break;
+      sum += next;
+      last++;
+    }
+    stage.last = last;
+    first = last;
+    stage_layers.push_back(stage);
+  }
+
+  activations.assign(this->micro_batches, std::vector<NN_Matrix>(layers));
+  deltas.assign(this->micro_batches, std::vector<NN_Matrix>(layers));
+  expected_rows.resize(this->micro_batches);
+  nn.bind_gradients(grads);
+
+  forward = std::vector<SpscQueue<int>>(count - 1);
+  backward = std::vector<SpscQueue<int>>(count - 1);
+
+  for (int s = 1; s < count; s++) threads.emplace_back(&Pipeline::_worker, this, s);
+}
+
+Pipeline::~Pipeline() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stop = true;
+  }
+  wake.notify_all();
+  for (std::thread& t : threads) t.join();
+}
+
+int Pipeline::stages() const {
+  return (int) stage_layers.size();
+}
+
+void Pipeline::_worker(int stage) {
+  unsigned seen = 0;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      wake.wait(lock, [&] { return stop || generation != seen; });
+      if (stop) return;
+      seen = generation;
+    }
+
+    _run(stage);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (--pending == 0) done.notify_one();
+  }
+}
+
+// Rows [B * m / M, B * (m + 1) / M) of src.
+static void _pipeline_rows(const NN_Matrix& src, int micro, int micro_batches, NN_Matrix& dst) {
+  int first = (int)((long long) src.rows() * micro / micro_batches);
+  int last = (int)((long long) src.rows() * (micro + 1) / micro_batches);
+  if (dst.rows() != last - first || dst.cols() != src.cols()) dst.init(last - first, src.cols());
+  for (int r = first; r < last; r++) {
+    memcpy(dst.row(r - first), src.row(r), src.cols() * sizeof(matrix_t));
+  }
+}
+
+void Pipeline::_forward(int stage, int micro) {
+  const Stage& st = stage_layers[stage];
+  std::vector<NN_Matrix>& a = activations[micro];
+  if (stage == 0) _pipeline_rows(*inputs, micro, micro_batches, a[0]);
+
+  for (int i = st.first; i < st.last; i++) {
+    Layer::forward(a[i], a[i - 1], nn.layers[i], nn.layers[i - 1], nn.sigmoid_mode);
+  }
+}
+
+// The same as NN::compute_gradients() for the layers of the stage, summed
+// into grads from one micro-batch to the next.
+void Pipeline::_backward(int stage, int micro) {
+  Stage& st = stage_layers[stage];
+  std::vector<NN_Matrix>& a = activations[micro];
+  std::vector<NN_Matrix>& d = deltas[micro];
+  const int layers = (int) nn.layers.size();
+
+  if (st.last == layers) {
+    NN_Matrix& exp = expected_rows[micro];
+    _pipeline_rows(*expected, micro, micro_batches, exp);
+    d[layers - 1] = a[layers - 1] - exp;
+    st.cost += d[layers - 1].multiply(d[layers - 1]).sum() / exp.cols();
+  }
+
+  const matrix_t beta = (micro == 0) ? 0 : 1;
+  for (int i = st.last - 1; i >= st.first; i--) {
+    if (micro == 0) grads.grad_biased[i].init(1, nn.layers[i].biased.cols());
+    grads.grad_biased[i].add_row_sums(d[i], 1);
+    grads.grad_weights[i - 1].gemm(a[i - 1], true, d[i], false, 1, beta);
+
+    // The input layer has no delta.
+    if (i == 1) break;
+
+    // delta(i - 1) = (delta(i) * w.trans()) x (a * (1-a)), handed to the
+    // previous stage if layer i - 1 is its.
+    d[i - 1].gemm(d[i], false, nn.layers[i - 1].weights, true);
+    d[i - 1] = d[i - 1].multiply(a[i - 1].multiply(1.f - a[i - 1]));
+  }
+}
+
+// Every micro-batch forward then back, as they come in.
+void Pipeline::_run(int stage) {
+  const int last = stages() - 1;
+  stage_layers[stage].cost = 0;
+
+  for (int m = 0; m < micro_batches; m++) {
+    int micro = (stage == 0) ? m : forward[stage - 1].pop();
+    _forward(stage, micro);
+    if (stage < last) forward[stage].push(micro);
+  }
+
+  for (int m = 0; m < micro_batches; m++) {
+    int micro = (stage == last) ? m : backward[stage].pop();
+    _backward(stage, micro);
+    if (stage > 0) backward[stage - 1].push(micro);
+  }
+}
+
+double Pipeline::train_batch(const NN_Matrix& inputs, const NN_Matrix& expected) {
+  assert(inputs.rows() == expected.rows());
+  assert(inputs.rows() >= micro_batches && "Less rows than micro-batches.");
+  this->inputs = &inputs;
+  this->expected = &expected;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    pending = (int) threads.size();
+    generation++;
+  }
+  wake.notify_all();
+
+  _run(0);
+
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&] { return pending == 0; });
+  }
+
+  nn.apply_gradients(grads, -nn.learn_rate / inputs.rows());
+  return stage_layers.back().cost;
+}
+
+float Pipeline::train_epoch(const Dataset& dataset, const std::vector<int>& order, int batch) {
+  assert(batch >= 1);
+  std::vector<int> indices;
+  NN_Matrix inputs, expected;
+
+  double cost = 0;
+  int done_samples = 0;
+  for (int first = 0; first < (int) order.size(); first += batch) {
+    int count = std::min(batch, (int) order.size() - first);
+    // A last batch too small to split is left out.
+    if (count < micro_batches) break;
+    indices.assign(order.begin() + first, order.begin() + first + count);
+
+    dataset.get_batch(indices, inputs, expected);
+    cost += train_batch(inputs, expected);
+    done_samples += count;
+  }
+  return done_samples > 0 ? (float)(cost / done_samples) : 0.f;
+}
+
+float Pipeline::train_epoch(BatchLoader& loader, const std::vector<int>& order, int batch) {
+  loader.start(order, batch);
+  double cost = 0;
+  int done_samples = 0;
+  while (const BatchLoader::Batch* b = loader.next()) {
+    // A last batch too small to split is left out.
+    if (b->inputs.rows() < micro_batches) continue;
+    cost += train_batch(b->inputs, b->expected);
+    done_samples += b->inputs.rows();
+  }
+  return done_samples > 0 ? (float)(cost / done_samples) : 0.f;
+}
+
+#endif // PIPELINE_HPP_INCLUDED
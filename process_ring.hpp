@@ -0,0 +1,251 @@
+#pragma once
+
+#ifndef PROCESS_RING_HPP_INCLUDED
+#define PROCESS_RING_HPP_INCLUDED
+
+// Data parallel training over several processes of one Linux box: the
+// trainer forks K ranks, each trains on its shard of the samples, and after
+// every batch their gradients are summed by a ring all-reduce in a shared
+// memory segment, so every rank applies the same step and the weights stay
+// the same everywhere.
+
+#if !defined(__linux__)
+#error "process_ring.hpp needs Linux (fork, shared memory, process shared barriers)."
+#endif
+
+#include <algorithm>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "nn.hpp"
+#include "dataset.hpp"
+
+// `ranks` buffers of `count` values in memory shared by the processes
+// forked after it's made, and a barrier for all of them.
+class ShmRing {
+public:
+  ShmRing(int ranks, size_t count);
+  ~ShmRing();
+
+  // Forks ranks() - 1 processes, returns the rank of the caller (0 for the
+  // one which called it). Call it before any thread is started.
+  int fork_ranks();
+  // Waits for the other ranks to exit, from rank 0. False if one failed.
+  bool wait_ranks();
+
+  int ranks() const { return _ranks; }
+  size_t count() const { return _count; }
+  matrix_t* buffer(int rank);
+
+  // Every rank calls it at once, afterwards every buffer holds the sum of
+  // all of them. Each chunk is summed in the same order on every rank, so
+  // the result is bit for bit the same everywhere.
+  void allreduce(int rank);
+  void barrier();
+
+private:
+  // [chunk_begin(c), chunk_begin(c + 1)) is chunk c of a buffer.
+  size_t _chunk_begin(int chunk) const;
+
+  int _ranks;
+  size_t _count;
+  size_t _stride;   // Values between the buffers, a multiple of NN_ALIGN.
+  size_t _bytes;
+  void* _memory = nullptr;
+  pthread_barrier_t* _barrier = nullptr;
+  matrix_t* _buffers = nullptr;
+  std::vector<pid_t> _children;
+  bool _parent = true;
+};
+
+ShmRing::ShmRing(int ranks, size_t count)
+  : _ranks(ranks > 0 ? ranks : 1), _count(count) {
+  _stride = nn_align_up(count, NN_ALIGN_FLOATS);
+  _bytes = NN_ALIGN + (size_t)_ranks * _stride * sizeof(matrix_t);
+
+  _memory = mmap(NULL, _bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  assert(_memory != MAP_FAILED && "Cannot map the shared memory.");
+
+  // The barrier takes the first cache line, the buffers the rest.
+  static_assert(sizeof(pthread_barrier_t) <= NN_ALIGN, "The barrier doesn't fit in NN_ALIGN bytes.");
+  _barrier = (pthread_barrier_t*) _memory;
+  _buffers = (matrix_t*)((char*) _memory + NN_ALIGN);
+
+  pthread_barrierattr_t attr;
+  pthread_barrierattr_init(&attr);
+  pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  int err = pthread_barrier_init(_barrier, &attr, _ranks);
+  pthread_barrierattr_destroy(&attr);
+  assert(err == 0);
+}
+
+ShmRing::~ShmRing() {
+  // The children only unmap their view, the barrier is rank 0's.
+  if (_parent) pthread_barrier_destroy(_barrier);
+  munmap(_memory, _bytes);
+}
+
+int ShmRing::fork_ranks() {
+  // Or what is buffered would be printed by every rank.
+  fflush(NULL);
+
+  for (int rank = 1; rank < _ranks; rank++) {
+    pid_t pid = fork();
+    assert(pid >= 0 && "Cannot fork a rank.");
+    if (pid == 0) {
+      _children.clear();
+      _parent = false;
+      return rank;
+    }
+    _children.push_back(pid);
+  }
+  return 0;
+}
+
+bool ShmRing::wait_ranks() {
+  bool ok = true;
+  for (pid_t pid : _children) {
+    int status = 0;
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) ok = false;
+  }
+  _children.clear();
+  return ok;
+}
+
+matrix_t* ShmRing::buffer(int rank) {
+  return _buffers + (size_t)rank * _stride;
+}
+
+void ShmRing::barrier() {
+  pthread_barrier_wait(_barrier);
+}
+
+size_t ShmRing::_chunk_begin(int chunk) const {
+  return _count * chunk / _ranks;
+}
+
+void ShmRing::allreduce(int rank) {
+  const int k = _ranks;
+  if (k == 1) return;
+
+  matrix_t* own = buffer(rank);
+  const matrix_t* prev = buffer((rank + k - 1) % k);
+
+  // The buffers are complete once every rank is here.
+  barrier();
+
+  // Reduce-scatter: at step s every rank adds chunk (rank - s - 1) of the
+  // previous rank to its own. The chunk a rank writes is never the one the
+  // next rank reads in the same step. After k - 1 steps chunk (rank + 1) is
+  // the full sum.
+  for (int s = 0; s < k - 1; s++) {
+    int c = ((rank - s - 1) % k + k) % k;
+    size_t begin = _chunk_begin(c), end = _chunk_begin(c + 1);
+    simd::kernels().add(own + begin, own + begin, prev + begin, end - begin);
+    barrier();
+  }
+
+  // All-gather: at step s every rank copies the full chunk (rank - s) from
+  // the previous rank.
+  for (int s = 0; s < k - 1; s++) {
+    int c = ((rank - s) % k + k) % k;
+    size_t begin = _chunk_begin(c), end = _chunk_begin(c + 1);
+    memcpy(own + begin, prev + begin, (end - begin) * sizeof(matrix_t));
+    barrier();
+  }
+}
+
+
+// The training of one rank: batches of its shard, gradients summed over the
+// ranks through the ring before every step.
+class RingTrainer {
+public:
+  RingTrainer(NN& nn, ShmRing& ring, int rank);
+
+  // Values a rank puts in the ring for nn: the gradients (laid out like
+  // nn.params), the rows and the cost of the batch.
+  static size_t ring_size(const NN& nn);
+  // The same for a NN with layers of these neurons, so the ring can be made
+  // before the ranks are forked, each building its own NN.
+  static size_t ring_size(const std::vector<int>& neurons);
+
+  // Mean squared error over the shards of every rank, shard is the samples
+  // of this one. Every rank has to do the same number of batches, so give
+  // them shards of the same size.
+  float train_epoch(const Dataset& dataset, const std::vector<int>& shard, int batch);
+
+private:
+  // Gradients in ws to the ring buffer, and back after the all-reduce.
+  void _pack(matrix_t* dst, int rows, double cost) const;
+  void _unpack(const matrix_t* src, int& rows, double& cost);
+
+  NN& nn;
+  ShmRing& ring;
+  int rank;
+
+  NN_Workspace ws;
+  NN_Matrix inputs;
+  NN_Matrix expected;
+  std::vector<int> indices;
+};
+
+RingTrainer::RingTrainer(NN& nn, ShmRing& ring, int rank) : nn(nn), ring(ring), rank(rank) {
+  assert(ring.count() == ring_size(nn));
+}
+
+size_t RingTrainer::ring_size(const NN& nn) {
+  return nn.params.data().size() + 2;
+}
+
+size_t RingTrainer::ring_size(const std::vector<int>& neurons) {
+  return NN::param_count(neurons) + 2;
+}
+
+void RingTrainer::_pack(matrix_t* dst, int rows, double cost) const {
+  const size_t count = ws.grad_params.data().size();
+  memcpy(dst, ws.grad_params.data().data(), count * sizeof(matrix_t));
+  dst[count] = (matrix_t) rows;
+  dst[count + 1] = (matrix_t) cost;
+}
+
+void RingTrainer::_unpack(const matrix_t* src, int& rows, double& cost) {
+  const size_t count = ws.grad_params.data().size();
+  memcpy(ws.grad_params.data().data(), src, count * sizeof(matrix_t));
+  rows = (int) src[count];
+  cost = src[count + 1];
+}
+
+float RingTrainer::train_epoch(const Dataset& dataset, const std::vector<int>& shard, int batch) {
+  assert(batch >= 1);
+  double cost = 0;
+  int samples = 0;
+
+  for (int first = 0; first < (int) shard.size(); first += batch) {
+    int count = std::min(batch, (int) shard.size() - first);
+    indices.assign(shard.begin() + first, shard.begin() + first + count);
+
+    dataset.get_batch(indices, inputs, expected);
+    nn.forward(inputs, ws);
+    double batch_cost = (ws.outputs.back() - expected).square().sum() / expected.cols();
+    nn.compute_gradients(expected, ws);
+
+    _pack(ring.buffer(rank), count, batch_cost);
+    ring.allreduce(rank);
+
+    int rows;
+    double sum_cost;
+    _unpack(ring.buffer(rank), rows, sum_cost);
+    nn.apply_gradients(ws, -nn.learn_rate / rows);
+
+    cost += sum_cost;
+    samples += rows;
+  }
+  return samples > 0 ? (float)(cost / samples) : 0.f;
+}
+
+#endif // PROCESS_RING_HPP_INCLUDED
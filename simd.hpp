@@ -0,0 +1,404 @@
+#pragma once
+
+#ifndef SIMD_HPP_INCLUDED
+#define SIMD_HPP_INCLUDED
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+  #define NN_SIMD_X86
+  #include <immintrin.h>
+#endif
+
+typedef float matrix_t;
+
+// Element-wise kernels used by NN_Matrix. There is a version for each of
+// AVX-512, AVX2 + FMA, SSE4.1 and plain C, and the best one the CPU (and the
+// OS) supports is picked once, the first time simd::kernels() is called.
+//
+// The NN_SIMD environment variable (scalar, sse4, avx2, avx512) forces a
+// lower instruction set, which is handy to compare the results.
+
+namespace simd {
+
+// How sigmoid() trades accuracy for speed:
+//   SIGMOID_EXACT     exp to about 2 ulp and a real division (max error ~1e-7).
+//   SIGMOID_APPROX    shorter exp polynomial and a refined reciprocal
+//                     estimate (max error ~2e-6).
+//   SIGMOID_SATURATE  SIGMOID_APPROX, but |x| > NN_SIGMOID_SAT is 0 or 1
+//                     right away, a whole vector of those skips the exp.
+//                     Meant for the large pre-activations of a trained net.
+enum SigmoidMode {
+  SIGMOID_EXACT,
+  SIGMOID_APPROX,
+  SIGMOID_SATURATE,
+};
+
+// Past 16 the sigmoid is within 1.2e-7 of 0 or 1.
+#define NN_SIGMOID_SAT 16.f
+
+// Coefficients of e^r = 1 + r + c2 r^2 + c3 r^3 + c4 r^4 for |r| <= ln2 / 2,
+// a minimax fit of the relative error (5.4e-6).
+#define NN_EXP_APPROX_C2 0.500051154f
+#define NN_EXP_APPROX_C3 0.167534666f
+#define NN_EXP_APPROX_C4 0.0412771869f
+
+struct Kernels {
+  const char* name;
+
+  void (*add)(matrix_t* dst, const matrix_t* a, const matrix_t* b, size_t n);
+  void (*sub)(matrix_t* dst, const matrix_t* a, const matrix_t* b, size_t n);
+  void (*mul)(matrix_t* dst, const matrix_t* a, const matrix_t* b, size_t n);
+  void (*scale)(matrix_t* dst, const matrix_t* a, matrix_t s, size_t n);
+  void (*axpb)(matrix_t* dst, const matrix_t* a, matrix_t s, matrix_t t, size_t n); // a * s + t
+  void (*axpy)(matrix_t* dst, const matrix_t* a, matrix_t s, size_t n); // dst += a * s
+  void (*square)(matrix_t* dst, const matrix_t* a, size_t n);
+  void (*sigmoid)(matrix_t* dst, const matrix_t* a, size_t n);
+  void (*sigmoid_approx)(matrix_t* dst, const matrix_t* a, size_t n);
+  void (*sigmoid_saturate)(matrix_t* dst, const matrix_t* a, size_t n);
+
+  matrix_t (*sum)(const matrix_t* a, size_t n);
+  size_t (*argmax)(const matrix_t* a, size_t n);
+};
+
+
+namespace scalar {
+
+static void add(matrix_t* dst, const matrix_t* a, const matrix_t* b, size_t n) {
+  for (size_t i = 0; i < n; i++) dst[i] = a[i] + b[i];
+}
+
+static void sub(matrix_t* dst, const matrix_t* a, const matrix_t* b, size_t n) {
+  for (size_t i = 0; i < n; i++) dst[i] = a[i] - b[i];
+}
+
+static void mul(matrix_t* dst, const matrix_t* a, const matrix_t* b, size_t n) {
+  for (size_t i = 0; i < n; i++) dst[i] = a[i] * b[i];
+}
+
+static void scale(matrix_t* dst, const matrix_t* a, matrix_t s, size_t n) {
+  for (size_t i = 0; i < n; i++) dst[i] = a[i] * s;
+}
+
+static void axpb(matrix_t* dst, const matrix_t* a, matrix_t s, matrix_t t, size_t n) {
+  for (size_t i = 0; i < n; i++) dst[i] = a[i] * s + t;
+}
+
+static void axpy(matrix_t* dst, const matrix_t* a, matrix_t s, size_t n) {
+  for (size_t i = 0; i < n; i++) dst[i] += a[i] * s;
+}
+
+static void square(matrix_t* dst, const matrix_t* a, size_t n) {
+  for (size_t i = 0; i < n; i++) dst[i] = a[i] * a[i];
+}
+
+static void sigmoid(matrix_t* dst, const matrix_t* a, size_t n) {
+  for (size_t i = 0; i < n; i++) dst[i] = 1.f / (1.f + expf(-a[i]));
+}
+
+static inline matrix_t _exp_approx(matrix_t x) {
+  if (x > 88.3762626647949f) x = 88.3762626647949f;
+  if (x < -87.3365447505531f) x = -87.3365447505531f;
+  matrix_t t = x * 1.44269504088896341f;
+  int i = (int)(t + (t < 0 ? -0.5f : 0.5f)); // Round to the nearest.
+  matrix_t n = (matrix_t) i;
+  matrix_t r = x - n * 0.693359375f + n * 2.12194440e-4f;
+  matrix_t y = (NN_EXP_APPROX_C4 * r + NN_EXP_APPROX_C3) * r + NN_EXP_APPROX_C2;
+
+  // 2^n straight from the exponent bits, n is in the normal range.
+  int bits = (i + 127) << 23;
+  matrix_t pow2;
+  memcpy(&pow2, &bits, sizeof pow2);
+  return (y * r * r + r + 1.f) * pow2;
+}
+
+static inline matrix_t sigmoid_approx(matrix_t x) {
+  return 1.f / (1.f + _exp_approx(-x));
+}
+
+static inline matrix_t sigmoid_saturate(matrix_t x) {
+  if (x > NN_SIGMOID_SAT) return 1.f;
+  if (x < -NN_SIGMOID_SAT) return 0.f;
+  return sigmoid_approx(x);
+}
+
+static void sigmoid_approx(matrix_t* dst, const matrix_t* a, size_t n) {
+  for (size_t i = 0; i < n; i++) dst[i] = sigmoid_approx(a[i]);
+}
+
+static void sigmoid_saturate(matrix_t* dst, const matrix_t* a, size_t n) {
+  for (size_t i = 0; i < n; i++) dst[i] = sigmoid_saturate(a[i]);
+}
+
+static matrix_t sum(const matrix_t* a, size_t n) {
+  matrix_t total = 0;
+  for (size_t i = 0; i < n; i++) total += a[i];
+  return total;
+}
+
+static size_t argmax(const matrix_t* a, size_t n) {
+  size_t index = 0;
+  for (size_t i = 1; i < n; i++) {
+    if (a[i] > a[index]) index = i;
+  }
+  return index;
+}
+
+static const Kernels table = {
+  "scalar",
+  add, sub, mul, scale, axpb, axpy, square, sigmoid, sigmoid_approx, sigmoid_saturate, sum, argmax,
+};
+
+} // namespace scalar
+
+
+#ifdef NN_SIMD_X86
+
+// SSE4.1 ----------------------------------------------------------------------
+
+#if defined(__clang__)
+  #pragma clang attribute push (__attribute__((target("sse4.1"))), apply_to = function)
+#else
+  #pragma GCC push_options
+  #pragma GCC target("sse4.1")
+#endif
+
+#define NN_SIMD_NS   sse4
+#define NN_SIMD_NAME "sse4"
+
+#define V_TYPE               __m128
+#define V_WIDTH              4
+#define V_LOAD(p)            _mm_loadu_ps(p)
+#define V_STORE(p, v)        _mm_storeu_ps((p), (v))
+#define V_SET1(x)            _mm_set1_ps(x)
+#define V_IOTA()             _mm_setr_ps(0, 1, 2, 3)
+#define V_ADD(a, b)          _mm_add_ps((a), (b))
+#define V_SUB(a, b)          _mm_sub_ps((a), (b))
+#define V_MUL(a, b)          _mm_mul_ps((a), (b))
+#define V_DIV(a, b)          _mm_div_ps((a), (b))
+#define V_MIN(a, b)          _mm_min_ps((a), (b))
+#define V_MAX(a, b)          _mm_max_ps((a), (b))
+#define V_FMADD(a, b, c)     _mm_add_ps(_mm_mul_ps((a), (b)), (c))
+#define V_ROUND(v)           _mm_round_ps((v), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+#define V_POW2I(n)           _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(_mm_cvtps_epi32(n), _mm_set1_epi32(127)), 23))
+#define V_SELECT_GT(a, b, x, y) _mm_blendv_ps((y), (x), _mm_cmpgt_ps((a), (b)))
+#define V_ALL_GT(a, b)       (_mm_movemask_ps(_mm_cmpgt_ps((a), (b))) == 0xF)
+#define V_ABS(v)             _mm_andnot_ps(_mm_set1_ps(-0.f), (v))
+#define V_RCP(v)             _mm_rcp_ps(v)
+
+#include "simd_kernels.inl"
+
+#undef NN_SIMD_NS
+#undef NN_SIMD_NAME
+
+#if defined(__clang__)
+  #pragma clang attribute pop
+#else
+  #pragma GCC pop_options
+#endif
+
+// AVX2 + FMA ------------------------------------------------------------------
+
+#if defined(__clang__)
+  #pragma clang attribute push (__attribute__((target("avx2,fma"))), apply_to = function)
+#else
+  #pragma GCC push_options
+  #pragma GCC target("avx2,fma")
+#endif
+
+#define NN_SIMD_NS   avx2
+#define NN_SIMD_NAME "avx2"
+
+#undef V_TYPE
+#undef V_WIDTH
+#undef V_LOAD
+#undef V_STORE
+#undef V_SET1
+#undef V_IOTA
+#undef V_ADD
+#undef V_SUB
+#undef V_MUL
+#undef V_DIV
+#undef V_MIN
+#undef V_MAX
+#undef V_FMADD
+#undef V_ROUND
+#undef V_POW2I
+#undef V_SELECT_GT
+#undef V_ALL_GT
+#undef V_ABS
+#undef V_RCP
+
+#define V_TYPE               __m256
+#define V_WIDTH              8
+#define V_LOAD(p)            _mm256_loadu_ps(p)
+#define V_STORE(p, v)        _mm256_storeu_ps((p), (v))
+#define V_SET1(x)            _mm256_set1_ps(x)
+#define V_IOTA()             _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7)
+#define V_ADD(a, b)          _mm256_add_ps((a), (b))
+#define V_SUB(a, b)          _mm256_sub_ps((a), (b))
+#define V_MUL(a, b)          _mm256_mul_ps((a), (b))
+#define V_DIV(a, b)          _mm256_div_ps((a), (b))
+#define V_MIN(a, b)          _mm256_min_ps((a), (b))
+#define V_MAX(a, b)          _mm256_max_ps((a), (b))
+#define V_FMADD(a, b, c)     _mm256_fmadd_ps((a), (b), (c))
+#define V_ROUND(v)           _mm256_round_ps((v), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+#define V_POW2I(n)           _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23))
+#define V_SELECT_GT(a, b, x, y) _mm256_blendv_ps((y), (x), _mm256_cmp_ps((a), (b), _CMP_GT_OQ))
+#define V_ALL_GT(a, b)       (_mm256_movemask_ps(_mm256_cmp_ps((a), (b), _CMP_GT_OQ)) == 0xFF)
+#define V_ABS(v)             _mm256_andnot_ps(_mm256_set1_ps(-0.f), (v))
+#define V_RCP(v)             _mm256_rcp_ps(v)
+
+#include "simd_kernels.inl"
+
+#undef NN_SIMD_NS
+#undef NN_SIMD_NAME
+
+#if defined(__clang__)
+  #pragma clang attribute pop
+#else
+  #pragma GCC pop_options
+#endif
+
+// AVX-512 ---------------------------------------------------------------------
+
+#if defined(__clang__)
+  #pragma clang attribute push (__attribute__((target("avx512f,avx2,fma"))), apply_to = function)
+#else
+  #pragma GCC push_options
+  #pragma GCC target("avx512f,avx2,fma")
+  // GCC 12 false positive on _mm512_undefined_ps() inside the intrinsics.
+  #pragma GCC diagnostic push
+  #pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+#define NN_SIMD_NS   avx512
+#define NN_SIMD_NAME "avx512"
+
+#undef V_TYPE
+#undef V_WIDTH
+#undef V_LOAD
+#undef V_STORE
+#undef V_SET1
+#undef V_IOTA
+#undef V_ADD
+#undef V_SUB
+#undef V_MUL
+#undef V_DIV
+#undef V_MIN
+#undef V_MAX
+#undef V_FMADD
+#undef V_ROUND
+#undef V_POW2I
+#undef V_SELECT_GT
+#undef V_ALL_GT
+#undef V_ABS
+#undef V_RCP
+
+#define V_TYPE               __m512
+#define V_WIDTH              16
+#define V_LOAD(p)            _mm512_loadu_ps(p)
+#define V_STORE(p, v)        _mm512_storeu_ps((p), (v))
+#define V_SET1(x)            _mm512_set1_ps(x)
+#define V_IOTA()             _mm512_setr_ps(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15)
+#define V_ADD(a, b)          _mm512_add_ps((a), (b))
+#define V_SUB(a, b)          _mm512_sub_ps((a), (b))
+#define V_MUL(a, b)          _mm512_mul_ps((a), (b))
+#define V_DIV(a, b)          _mm512_div_ps((a), (b))
+#define V_MIN(a, b)          _mm512_min_ps((a), (b))
+#define V_MAX(a, b)          _mm512_max_ps((a), (b))
+#define V_FMADD(a, b, c)     _mm512_fmadd_ps((a), (b), (c))
+#define V_ROUND(v)           _mm512_roundscale_ps((v), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+#define V_POW2I(n)           _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_add_epi32(_mm512_cvtps_epi32(n), _mm512_set1_epi32(127)), 23))
+#define V_SELECT_GT(a, b, x, y) _mm512_mask_blend_ps(_mm512_cmp_ps_mask((a), (b), _CMP_GT_OQ), (y), (x))
+#define V_ALL_GT(a, b)       (_mm512_cmp_ps_mask((a), (b), _CMP_GT_OQ) == 0xFFFF)
+#define V_ABS(v)             _mm512_abs_ps(v)
+#define V_RCP(v)             _mm512_rcp14_ps(v)
+
+#include "simd_kernels.inl"
+
+#undef NN_SIMD_NS
+#undef NN_SIMD_NAME
+
+#if defined(__clang__)
+  #pragma clang attribute pop
+#else
+  #pragma GCC diagnostic pop
+  #pragma GCC pop_options
+#endif
+
+#undef V_TYPE
+#undef V_WIDTH
+#undef V_LOAD
+#undef V_STORE
+#undef V_SET1
+#undef V_IOTA
+#undef V_ADD
+#undef V_SUB
+#undef V_MUL
+#undef V_DIV
+#undef V_MIN
+#undef V_MAX
+#undef V_FMADD
+#undef V_ROUND
+#undef V_POW2I
+#undef V_SELECT_GT
+#undef V_ALL_GT
+#undef V_ABS
+#undef V_RCP
+
+#endif // NN_SIMD_X86
+
+
+// Query the CPU (cpuid, and xgetbv for the OS support of the wider registers,
+// both done by __builtin_cpu_supports) and pick the widest kernel set.
+static const Kernels* _detect() {
+  const char* force = getenv("NN_SIMD");
+  int limit = 3; // 0 = scalar, 1 = sse4, 2 = avx2, 3 = avx512.
+  if (force != NULL) {
+    if (strcmp(force, "scalar") == 0) limit = 0;
+    else if (strcmp(force, "sse4") == 0) limit = 1;
+    else if (strcmp(force, "avx2") == 0) limit = 2;
+  }
+
+#ifdef NN_SIMD_X86
+  __builtin_cpu_init();
+  if (limit >= 3 && __builtin_cpu_supports("avx512f")) return &avx512::table;
+  if (limit >= 2 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return &avx2::table;
+  if (limit >= 1 && __builtin_cpu_supports("sse4.1")) return &sse4::table;
+#endif
+
+  (void) limit;
+  return &scalar::table;
+}
+
+static inline const Kernels& kernels() {
+  static const Kernels* table = _detect();
+  return *table;
+}
+
+typedef void (*Unary)(matrix_t* dst, const matrix_t* a, size_t n);
+
+static inline Unary sigmoid_kernel(SigmoidMode mode) {
+  switch (mode) {
+    case SIGMOID_APPROX: return kernels().sigmoid_approx;
+    case SIGMOID_SATURATE: return kernels().sigmoid_saturate;
+    default: return kernels().sigmoid;
+  }
+}
+
+// A single value, for the odd scalar use outside of a matrix.
+static inline matrix_t sigmoid(matrix_t x, SigmoidMode mode) {
+  switch (mode) {
+    case SIGMOID_APPROX: return scalar::sigmoid_approx(x);
+    case SIGMOID_SATURATE: return scalar::sigmoid_saturate(x);
+    default: return 1.f / (1.f + expf(-x));
+  }
+}
+
+} // namespace simd
+
+#endif // SIMD_HPP_INCLUDED
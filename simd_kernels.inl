@@ -0,0 +1,224 @@
+// Element-wise kernels, written once against the V_* macros and included by
+// simd.hpp once per instruction set, inside that set's target region.
+//
+// NN_SIMD_NS    namespace to put the kernels in.
+// NN_SIMD_NAME  printable name of the instruction set.
+// V_TYPE        vector of V_WIDTH floats.
+//
+// Every kernel works on unaligned pointers and finishes the tail which
+// doesn't fill a whole vector with scalar code. dst may alias a source.
+
+namespace NN_SIMD_NS {
+
+static void add(matrix_t* dst, const matrix_t* a, const matrix_t* b, size_t n) {
+  size_t i = 0;
+  for (; i + V_WIDTH <= n; i += V_WIDTH)
+    V_STORE(dst + i, V_ADD(V_LOAD(a + i), V_LOAD(b + i)));
+  for (; i < n; i++) dst[i] = a[i] + b[i];
+}
+
+static void sub(matrix_t* dst, const matrix_t* a, const matrix_t* b, size_t n) {
+  size_t i = 0;
+  for (; i + V_WIDTH <= n; i += V_WIDTH)
+    V_STORE(dst + i, V_SUB(V_LOAD(a + i), V_LOAD(b + i)));
+  for (; i < n; i++) dst[i] = a[i] - b[i];
+}
+
+static void mul(matrix_t* dst, const matrix_t* a, const matrix_t* b, size_t n) {
+  size_t i = 0;
+  for (; i + V_WIDTH <= n; i += V_WIDTH)
+    V_STORE(dst + i, V_MUL(V_LOAD(a + i), V_LOAD(b + i)));
+  for (; i < n; i++) dst[i] = a[i] * b[i];
+}
+
+static void scale(matrix_t* dst, const matrix_t* a, matrix_t s, size_t n) {
+  const V_TYPE vs = V_SET1(s);
+  size_t i = 0;
+  for (; i + V_WIDTH <= n; i += V_WIDTH)
+    V_STORE(dst + i, V_MUL(V_LOAD(a + i), vs));
+  for (; i < n; i++) dst[i] = a[i] * s;
+}
+
+static void axpb(matrix_t* dst, const matrix_t* a, matrix_t s, matrix_t t, size_t n) {
+  const V_TYPE vs = V_SET1(s), vt = V_SET1(t);
+  size_t i = 0;
+  for (; i + V_WIDTH <= n; i += V_WIDTH)
+    V_STORE(dst + i, V_FMADD(V_LOAD(a + i), vs, vt));
+  for (; i < n; i++) dst[i] = a[i] * s + t;
+}
+
+static void axpy(matrix_t* dst, const matrix_t* a, matrix_t s, size_t n) {
+  const V_TYPE vs = V_SET1(s);
+  size_t i = 0;
+  for (; i + V_WIDTH <= n; i += V_WIDTH)
+    V_STORE(dst + i, V_FMADD(V_LOAD(a + i), vs, V_LOAD(dst + i)));
+  for (; i < n; i++) dst[i] += a[i] * s;
+}
+
+static void square(matrix_t* dst, const matrix_t* a, size_t n) {
+  size_t i = 0;
+  for (; i + V_WIDTH <= n; i += V_WIDTH) {
+    V_TYPE v = V_LOAD(a + i);
+    V_STORE(dst + i, V_MUL(v, v));
+  }
+  for (; i < n; i++) dst[i] = a[i] * a[i];
+}
+
+// exp(x) as 2^n * e^r with n = round(x / ln2) and |r| <= ln2 / 2, where e^r
+// is a degree 5 polynomial (Cephes expf), good to about 2 ulp. x is clamped
+// so 2^n stays a normal float.
+static inline V_TYPE _exp(V_TYPE x) {
+  x = V_MIN(x, V_SET1(88.3762626647949f));
+  x = V_MAX(x, V_SET1(-87.3365447505531f));
+
+  V_TYPE n = V_ROUND(V_MUL(x, V_SET1(1.44269504088896341f)));
+  x = V_FMADD(n, V_SET1(-0.693359375f), x);
+  x = V_FMADD(n, V_SET1(2.12194440e-4f), x);
+
+  V_TYPE y = V_SET1(1.9875691500E-4f);
+  y = V_FMADD(y, x, V_SET1(1.3981999507E-3f));
+  y = V_FMADD(y, x, V_SET1(8.3334519073E-3f));
+  y = V_FMADD(y, x, V_SET1(4.1665795894E-2f));
+  y = V_FMADD(y, x, V_SET1(1.6666665459E-1f));
+  y = V_FMADD(y, x, V_SET1(5.0000001201E-1f));
+  y = V_FMADD(y, V_MUL(x, x), V_ADD(x, V_SET1(1.f)));
+
+  return V_MUL(y, V_POW2I(n));
+}
+
+static void sigmoid(matrix_t* dst, const matrix_t* a, size_t n) {
+  const V_TYPE one = V_SET1(1.f);
+  const V_TYPE zero = V_SET1(0.f);
+  size_t i = 0;
+  for (; i + V_WIDTH <= n; i += V_WIDTH) {
+    V_TYPE e = _exp(V_SUB(zero, V_LOAD(a + i)));
+    V_STORE(dst + i, V_DIV(one, V_ADD(one, e)));
+  }
+  for (; i < n; i++) dst[i] = 1.f / (1.f + expf(-a[i]));
+}
+
+// Same reduction as _exp() with the shorter polynomial.
+static inline V_TYPE _exp_approx(V_TYPE x) {
+  x = V_MIN(x, V_SET1(88.3762626647949f));
+  x = V_MAX(x, V_SET1(-87.3365447505531f));
+
+  V_TYPE n = V_ROUND(V_MUL(x, V_SET1(1.44269504088896341f)));
+  x = V_FMADD(n, V_SET1(-0.693359375f), x);
+  x = V_FMADD(n, V_SET1(2.12194440e-4f), x);
+
+  V_TYPE y = V_SET1(NN_EXP_APPROX_C4);
+  y = V_FMADD(y, x, V_SET1(NN_EXP_APPROX_C3));
+  y = V_FMADD(y, x, V_SET1(NN_EXP_APPROX_C2));
+  y = V_FMADD(y, V_MUL(x, x), V_ADD(x, V_SET1(1.f)));
+
+  return V_MUL(y, V_POW2I(n));
+}
+
+// 1 / (1 + e^-x) with the reciprocal estimate and one Newton step instead of
+// the division.
+static inline V_TYPE _sigmoid_approx(V_TYPE x) {
+  V_TYPE d = V_ADD(V_SET1(1.f), _exp_approx(V_SUB(V_SET1(0.f), x)));
+  V_TYPE r = V_RCP(d);
+  return V_MUL(r, V_SUB(V_SET1(2.f), V_MUL(d, r)));
+}
+
+static void sigmoid_approx(matrix_t* dst, const matrix_t* a, size_t n) {
+  size_t i = 0;
+  for (; i + V_WIDTH <= n; i += V_WIDTH)
+    V_STORE(dst + i, _sigmoid_approx(V_LOAD(a + i)));
+  for (; i < n; i++) dst[i] = scalar::sigmoid_approx(a[i]);
+}
+
+static void sigmoid_saturate(matrix_t* dst, const matrix_t* a, size_t n) {
+  const V_TYPE one = V_SET1(1.f);
+  const V_TYPE zero = V_SET1(0.f);
+  const V_TYPE sat = V_SET1(NN_SIGMOID_SAT);
+  const V_TYPE neg_sat = V_SET1(-NN_SIGMOID_SAT);
+  size_t i = 0;
+  for (; i + V_WIDTH <= n; i += V_WIDTH) {
+    V_TYPE x = V_LOAD(a + i);
+    V_TYPE y;
+    if (V_ALL_GT(V_ABS(x), sat)) {
+      y = V_SELECT_GT(x, zero, one, zero);
+    } else {
+      y = _sigmoid_approx(x);
+      y = V_SELECT_GT(neg_sat, x, zero, V_SELECT_GT(x, sat, one, y));
+    }
+    V_STORE(dst + i, y);
+  }
+  for (; i < n; i++) dst[i] = scalar::sigmoid_saturate(a[i]);
+}
+
+static matrix_t sum(const matrix_t* a, size_t n) {
+  // Two independent accumulators to hide the add latency.
+  V_TYPE acc0 = V_SET1(0.f), acc1 = V_SET1(0.f);
+  size_t i = 0;
+  for (; i + 2 * V_WIDTH <= n; i += 2 * V_WIDTH) {
+    acc0 = V_ADD(acc0, V_LOAD(a + i));
+    acc1 = V_ADD(acc1, V_LOAD(a + i + V_WIDTH));
+  }
+  for (; i + V_WIDTH <= n; i += V_WIDTH) {
+    acc0 = V_ADD(acc0, V_LOAD(a + i));
+  }
+
+  matrix_t lanes[V_WIDTH];
+  V_STORE(lanes, V_ADD(acc0, acc1));
+
+  matrix_t total = 0;
+  for (int l = 0; l < V_WIDTH; l++) total += lanes[l];
+  for (; i < n; i++) total += a[i];
+  return total;
+}
+
+// Index of the first maximum. Every lane keeps its own maximum and where it
+// was found (as a float, exact below 2^24), then the lanes are reduced.
+static size_t argmax(const matrix_t* a, size_t n) {
+  if (n == 0) return 0;
+
+  size_t i = 0;
+  size_t best_index = 0;
+  matrix_t best = a[0];
+
+  if (n >= V_WIDTH && n < (1u << 24)) {
+    V_TYPE vmax = V_LOAD(a);
+    V_TYPE vidx = V_IOTA();
+    V_TYPE curr = vidx;
+    const V_TYPE step = V_SET1((matrix_t) V_WIDTH);
+
+    for (i = V_WIDTH; i + V_WIDTH <= n; i += V_WIDTH) {
+      curr = V_ADD(curr, step);
+      V_TYPE v = V_LOAD(a + i);
+      vidx = V_SELECT_GT(v, vmax, curr, vidx);
+      vmax = V_SELECT_GT(v, vmax, v, vmax);
+    }
+
+    matrix_t lane_max[V_WIDTH], lane_idx[V_WIDTH];
+    V_STORE(lane_max, vmax);
+    V_STORE(lane_idx, vidx);
+
+    best = lane_max[0];
+    best_index = (size_t) lane_idx[0];
+    for (int l = 1; l < V_WIDTH; l++) {
+      size_t index = (size_t) lane_idx[l];
+      if (lane_max[l] > best || (lane_max[l] == best && index < best_index)) {
+        best = lane_max[l];
+        best_index = index;
+      }
+    }
+  }
+
+  for (; i < n; i++) {
+    if (a[i] > best) {
+      best = a[i];
+      best_index = i;
+    }
+  }
+  return best_index;
+}
+
+static const Kernels table = {
+  NN_SIMD_NAME,
+  add, sub, mul, scale, axpb, axpy, square, sigmoid, sigmoid_approx, sigmoid_saturate, sum, argmax,
+};
+
+} // namespace NN_SIMD_NS
@@ -0,0 +1,89 @@
+#pragma once
+
+#ifndef SPSC_QUEUE_HPP_INCLUDED
+#define SPSC_QUEUE_HPP_INCLUDED
+
+#include <atomic>
+#include <chrono>
+#include <stddef.h>
+#include <thread>
+#include <vector>
+
+// A bounded queue between one producer thread and one consumer thread,
+// without locks: the producer only moves the tail, the consumer the head.
+// push() waits while it's full and pop() while it's empty.
+template <class T>
+class SpscQueue {
+public:
+  explicit SpscQueue(size_t capacity = 64);
+
+  bool try_push(const T& value);
+  bool try_pop(T& value);
+
+  void push(const T& value);
+  T pop();
+
+private:
+  static void _wait(int& spins);
+
+  std::vector<T> _items;
+  const size_t _mask;
+
+  // Apart, so the two threads don't fight over a cache line.
+  alignas(64) std::atomic<size_t> _head{ 0 };
+  alignas(64) std::atomic<size_t> _tail{ 0 };
+};
+
+static inline size_t _spsc_capacity(size_t capacity) {
+  size_t size = 1;
+  while (size < capacity) size *= 2;
+  return size;
+}
+
+template <class T>
+SpscQueue<T>::SpscQueue(size_t capacity)
+  : _items(_spsc_capacity(capacity)), _mask(_spsc_capacity(capacity) - 1) {}
+
+template <class T>
+bool SpscQueue<T>::try_push(const T& value) {
+  size_t tail = _tail.load(std::memory_order_relaxed);
+  if (tail - _head.load(std::memory_order_acquire) == _items.size()) return false;
+  _items[tail & _mask] = value;
+  _tail.store(tail + 1, std::memory_order_release);
+  return true;
+}
+
+template <class T>
+bool SpscQueue<T>::try_pop(T& value) {
+  size_t head = _head.load(std::memory_order_relaxed);
+  if (head == _tail.load(std::memory_order_acquire)) return false;
+  value = _items[head & _mask];
+  _head.store(head + 1, std::memory_order_release);
+  return true;
+}
+
+// Spins first, the other side is usually about to be done, then yields, and
+// sleeps if it's taking long (or there are more threads than cores).
+template <class T>
+void SpscQueue<T>::_wait(int& spins) {
+  spins++;
+  if (spins < 64) return;
+  if (spins < 128) std::this_thread::yield();
+  else std::this_thread::sleep_for(std::chrono::microseconds(50));
+}
+
+template <class T>
+void SpscQueue<T>::push(const T& value) {
+  int spins = 0;
+  while (!try_push(value)) _wait(spins);
+}
+
+template <class T>
+T SpscQueue<T>::pop() {
+  T value;
+  int spins = 0;
+  while (!try_pop(value)) _wait(spins);
+  return value;
+}
+
+#endif // SPSC_QUEUE_HPP_INCLUDED
@@ -0,0 +1,176 @@
+#pragma once
+
+#ifndef STORAGE_HPP_INCLUDED
+#define STORAGE_HPP_INCLUDED
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <utility>
+
+#if defined(_WIN32)
+  #include <malloc.h>
+#endif
+
+typedef float matrix_t;
+
+// Alignment of every matrix buffer: a cache line, which is also the size of
+// an AVX-512 register. Capacities are rounded up to it too, so two buffers
+// never share a line (no false sharing between threads owning them).
+#define NN_ALIGN 64
+#define NN_ALIGN_FLOATS (NN_ALIGN / sizeof(matrix_t))
+
+static inline size_t nn_align_up(size_t count, size_t to) {
+  return (count + to - 1) / to * to;
+}
+
+static inline void* nn_aligned_alloc(size_t bytes) {
+  if (bytes == 0) return nullptr;
+#if defined(_WIN32)
+  return _aligned_malloc(bytes, NN_ALIGN);
+#else
+  void* ptr = nullptr;
+  if (posix_memalign(&ptr, NN_ALIGN, bytes) != 0) return nullptr;
+  return ptr;
+#endif
+}
+
+static inline void nn_aligned_free(void* ptr) {
+#if defined(_WIN32)
+  _aligned_free(ptr);
+#else
+  free(ptr);
+#endif
+}
+
+
+// A NN_ALIGN aligned, growable array of matrix_t with the subset of the
+// std::vector interface the matrices use. The space between size() and
+// capacity() is kept zeroed, so a kernel may read whole vectors past the end.
+//
+// It can also be a view of a part of a larger buffer it doesn't own (the
+// parameters of a NN, see NN::params): it never reallocates then, growing
+// it past its capacity aborts. Assigning to a view copies into it, moving
+// one hands the view over.
+class NN_Storage {
+public:
+  NN_Storage() {}
+  explicit NN_Storage(size_t size, matrix_t val = 0) { assign(size, val); }
+
+  NN_Storage(const NN_Storage& other) { *this = other; }
+  NN_Storage(NN_Storage&& other) noexcept { swap(other); }
+  ~NN_Storage() {
+    if (!_view) nn_aligned_free(_data);
+  }
+
+  NN_Storage& operator=(const NN_Storage& other) {
+    if (this == &other) return *this;
+    _reserve(other._size, false);
+    if (other._size > 0) memcpy(_data, other._data, other._size * sizeof(matrix_t));
+    _set_size(other._size);
+    return *this;
+  }
+
+  NN_Storage& operator=(NN_Storage&& other) noexcept {
+    if (_view) return *this = other;
+    swap(other);
+    return *this;
+  }
+
+  void swap(NN_Storage& other) noexcept {
+    std::swap(_data, other._data);
+    std::swap(_size, other._size);
+    std::swap(_capacity, other._capacity);
+    std::swap(_view, other._view);
+  }
+
+  // Empty, on capacity values at data (NN_ALIGN aligned), which must outlive
+  // it. The caller zeroes what ends up past size().
+  void view(matrix_t* data, size_t capacity) {
+    if (!_view) nn_aligned_free(_data);
+    _data = data;
+    _size = 0;
+    _capacity = capacity;
+    _view = true;
+  }
+
+  // Resize to size and fill with val, reusing the buffer if it's large enough.
+  void assign(size_t size, matrix_t val) {
+    _reserve(size, false);
+    for (size_t i = 0; i < size; i++) _data[i] = val;
+    _set_size(size);
+  }
+
+  // assign(size, 0), except that a new buffer is zeroed by zero(data, size)
+  // and not here, so the caller can split that between the threads which
+  // will use the memory: the first thread to touch a page is the one whose
+  // NUMA node it's placed on.
+  template <class F>
+  void assign_zero(size_t size, F&& zero) {
+    if (size > _capacity) {
+      if (_view) abort();
+      size_t capacity = nn_align_up(size, NN_ALIGN_FLOATS);
+      matrix_t* data = (matrix_t*) nn_aligned_alloc(capacity * sizeof(matrix_t));
+      if (data == nullptr) abort();
+      memset(data + size, 0, (capacity - size) * sizeof(matrix_t));
+
+      nn_aligned_free(_data);
+      _data = data;
+      _capacity = capacity;
+      _size = 0;
+    }
+    zero(_data, size);
+    _set_size(size);
+  }
+
+  // Resize keeping the contents, new elements are zero.
+  void resize(size_t size) {
+    _reserve(size, true);
+    _set_size(size);
+  }
+
+  size_t size() const { return _size; }
+  size_t capacity() const { return _capacity; }
+  bool empty() const { return _size == 0; }
+
+  matrix_t* data() { return _data; }
+  const matrix_t* data() const { return _data; }
+
+  matrix_t& operator[](size_t i) { return _data[i]; }
+  const matrix_t& operator[](size_t i) const { return _data[i]; }
+
+  matrix_t* begin() { return _data; }
+  matrix_t* end() { return _data + _size; }
+  const matrix_t* begin() const { return _data; }
+  const matrix_t* end() const { return _data + _size; }
+
+private:
+  void _reserve(size_t size, bool keep) {
+    if (size <= _capacity) return;
+    if (_view) abort();
+
+    size_t capacity = nn_align_up(size, NN_ALIGN_FLOATS);
+    matrix_t* data = (matrix_t*) nn_aligned_alloc(capacity * sizeof(matrix_t));
+    if (data == nullptr) abort();
+    memset(data, 0, capacity * sizeof(matrix_t));
+
+    if (keep && _size > 0) memcpy(data, _data, _size * sizeof(matrix_t));
+    nn_aligned_free(_data);
+
+    _data = data;
+    _capacity = capacity;
+  }
+
+  // Shrinking clears the now unused tail, to keep the slack zeroed.
+  void _set_size(size_t size) {
+    if (size < _size) memset(_data + size, 0, (_size - size) * sizeof(matrix_t));
+    _size = size;
+  }
+
+  matrix_t* _data = nullptr;
+  size_t _size = 0;
+  size_t _capacity = 0;
+  bool _view = false;
+};
+
+#endif // STORAGE_HPP_INCLUDED
@@ -0,0 +1,467 @@
+// Headless trainer / evaluator, no raylib needed:
+//
+//   g++ -O2 -std=c++17 -pthread trainer.cpp -o trainer
+//   ./trainer --epochs 5 --batch 16 --lr 0.1 --save nn
+//   ./trainer --load nn --epochs 0
+//
+// Run without arguments it trains the same 784-20-10-10 network as the GUI
+// on ./datasets, as fast as it can, and reports the test accuracy.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <string>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+
+#include "matrix.hpp"
+#include "nn.hpp"
+#include "dataset.hpp"
+#include "idx_stream.hpp"
+#include "parallel.hpp"
+#include "numa.hpp"
+#include "hogwild.hpp"
+#include "data_parallel.hpp"
+#include "pipeline.hpp"
+#include "loader.hpp"
+#if defined(__linux__)
+#include "process_ring.hpp"
+#endif
+
+struct Options {
+    std::string data = "./datasets";
+    std::vector<int> layers = { 784, 20, 10, 10 };
+    int epochs = 5;
+    int batch = 1;
+    int threads = 1;
+    int replicas = 1;
+    int procs = 1;
+    int stages = 1;
+    int micro_batches = 4;
+    int pool_threads = 0;
+    int stream_mb = 0;
+    int prefetch = 0;
+    int loaders = 1;
+    bool pin = false;
+    bool numa = false;
+    float learn_rate = 0.01f;
+    bool shuffle = false;
+    bool cache = false;
+    unsigned seed = 0;
+    simd::SigmoidMode sigmoid_mode = simd::SIGMOID_EXACT;
+    const char* load = nullptr;
+    const char* save = nullptr;
+};
+
+static void usage(const char* name) {
+    printf(
+        "usage: %s [options]\n"
+        "  --data DIR         directory of the MNIST idx files (./datasets)\n"
+        "  --layers A,B,...   neurons per layer (784,20,10,10)\n"
+        "  --epochs N         passes over the training set, 0 only tests (5)\n"
+        "  --batch N          samples per gradient step (1)\n"
+        "  --threads N        train with N workers updating the weights\n"
+        "                     without locks (Hogwild!), on the pool (1)\n"
+        "  --replicas N       split every batch in N slices trained in\n"
+        "                     parallel, the same result for the same N (1)\n"
+        "  --procs N          train in N processes (Linux only), each on a\n"
+        "                     shard of the samples, summing their gradients\n"
+        "                     in shared memory after every batch (1)\n"
+        "  --stages N         split the layers in N stages on their own\n"
+        "                     threads, batches streaming through them (1)\n"
+        "  --micro N          micro-batches per batch with --stages (4)\n"
+        "  --pool N           threads of the pool every parallel loop runs\n"
+        "                     on, the main one included, per process with\n"
+        "                     --procs (NN_THREADS, or the number of cores,\n"
+        "                     shared by the processes)\n"
+        "  --pin              pin the threads of the pool to cores, Linux\n"
+        "                     only (NN_PIN=1)\n"
+        "  --numa             keep the threads of the pool on the NUMA nodes,\n"
+        "                     a shard of the dataset and a copy of the\n"
+        "                     weights on each, and report the pages\n"
+        "                     allocated across nodes every epoch (NN_NUMA=1)\n"
+        "  --stream MB        read the idx files a chunk at a time through a\n"
+        "                     cache of MB per file instead of mapping them,\n"
+        "                     for a dataset larger than the memory\n"
+        "  --cache            read the inputs as floats from DIR/*.f32 files,\n"
+        "                     written by the first run with it\n"
+        "  --prefetch N       gather the next N batches on other threads\n"
+        "                     while one trains, serial or with --stages\n"
+        "                     only, and report how long training waited (0)\n"
+        "  --loaders N        threads gathering them with --prefetch (1)\n"
+        "  --lr X             learning rate (0.01)\n"
+        "  --shuffle          shuffle the samples every epoch\n"
+        "  --seed N           seed of the weights and the shuffle (0)\n"
+        "  --sigmoid MODE     exact, approx or saturate (exact)\n"
+        "  --load FILE        start from a saved network\n"
+        "  --save FILE        save the network after training\n",
+        name);
+}
+
+static bool parse_layers(const char* arg, std::vector<int>& layers) {
+    layers.clear();
+    while (*arg) {
+        char* end;
+        long value = strtol(arg, &end, 10);
+        if (end == arg || value <= 0) return false;
+        layers.push_back((int) value);
+        arg = (*end == ',') ? end + 1 : end;
+    }
+    return layers.size() >= 2;
+}
+
+// The ways of going parallel asked for, one at a time.
+static int ways(const Options& opt) {
+    return (opt.threads > 1) + (opt.replicas > 1) + (opt.procs > 1) + (opt.stages > 1);
+}
+
+static bool parse_options(int argc, char** argv, Options& opt) {
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+
+        if (strcmp(arg, "--shuffle") == 0) { opt.shuffle = true; continue; }
+        if (strcmp(arg, "--pin") == 0) { opt.pin = true; continue; }
+        if (strcmp(arg, "--numa") == 0) { opt.numa = true; continue; }
+        if (strcmp(arg, "--cache") == 0) { opt.cache = true; continue; }
+        if (value == nullptr) return false;
+        i++;
+
+        if (strcmp(arg, "--data") == 0) opt.data = value;
+        else if (strcmp(arg, "--layers") == 0) { if (!parse_layers(value, opt.layers)) return false; }
+        else if (strcmp(arg, "--epochs") == 0) opt.epochs = atoi(value);
+        else if (strcmp(arg, "--batch") == 0) opt.batch = atoi(value);
+        else if (strcmp(arg, "--threads") == 0) opt.threads = atoi(value);
+        else if (strcmp(arg, "--replicas") == 0) opt.replicas = atoi(value);
+        else if (strcmp(arg, "--procs") == 0) opt.procs = atoi(value);
+        else if (strcmp(arg, "--stages") == 0) opt.stages = atoi(value);
+        else if (strcmp(arg, "--micro") == 0) opt.micro_batches = atoi(value);
+        else if (strcmp(arg, "--pool") == 0) opt.pool_threads = atoi(value);
+        else if (strcmp(arg, "--stream") == 0) opt.stream_mb = atoi(value);
+        else if (strcmp(arg, "--prefetch") == 0) opt.prefetch = atoi(value);
+        else if (strcmp(arg, "--loaders") == 0) opt.loaders = atoi(value);
+        else if (strcmp(arg, "--lr") == 0) opt.learn_rate = (float) atof(value);
+        else if (strcmp(arg, "--seed") == 0) opt.seed = (unsigned) atoi(value);
+        else if (strcmp(arg, "--load") == 0) opt.load = value;
+        else if (strcmp(arg, "--save") == 0) opt.save = value;
+        else if (strcmp(arg, "--sigmoid") == 0) {
+            if (strcmp(value, "exact") == 0) opt.sigmoid_mode = simd::SIGMOID_EXACT;
+            else if (strcmp(value, "approx") == 0) opt.sigmoid_mode = simd::SIGMOID_APPROX;
+            else if (strcmp(value, "saturate") == 0) opt.sigmoid_mode = simd::SIGMOID_SATURATE;
+            else return false;
+        }
+        else return false;
+    }
+#if !defined(__linux__)
+    if (opt.procs != 1) return false;
+#endif
+    return opt.epochs >= 0 && opt.batch >= 1 && opt.threads >= 1 && opt.replicas >= 1 &&
+        opt.procs >= 1 && opt.stages >= 1 && opt.micro_batches >= 1 && opt.pool_threads >= 0 &&
+        opt.prefetch >= 0 && opt.loaders >= 1 && ways(opt) <= 1 &&
+        // The loader feeds the serial loop and the stages only.
+        (opt.prefetch == 0 || ways(opt) == 0 || opt.stages > 1);
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Mean squared error of one epoch.
+static float train_epoch(NN& nn, const Dataset& dataset, std::vector<int>& order, int batch) {
+    std::vector<int> indices;
+    indices.reserve(batch);
+    NN_Matrix inputs, expected;
+
+    double cost = 0;
+    for (int first = 0; first < (int) order.size(); first += batch) {
+        int count = std::min(batch, (int) order.size() - first);
+        indices.assign(order.begin() + first, order.begin() + first + count);
+
+        dataset.get_batch(indices, inputs, expected);
+        nn.forward(inputs);
+        cost += (nn.get_outputs() - expected).square().sum() / expected.cols();
+        nn.backprop(expected);
+    }
+    return (float)(cost / order.size());
+}
+
+// The same with the batches of loader, gathered while the previous trains.
+static float train_epoch(NN& nn, BatchLoader& loader, const std::vector<int>& order, int batch) {
+    loader.start(order, batch);
+    double cost = 0;
+    while (const BatchLoader::Batch* b = loader.next()) {
+        nn.forward(b->inputs);
+        cost += (nn.get_outputs() - b->expected).square().sum() / b->expected.cols();
+        nn.backprop(b->expected);
+    }
+    return (float)(cost / order.size());
+}
+
+static void print_loader(const BatchLoader& loader, double elapsed) {
+    BatchLoader::Stats stats = loader.stats();
+    printf("Loader | waited %.2fs (%.1f%% of the epoch) for %d of %d batches | gathering took %.2fs\n",
+        stats.wait, elapsed > 0 ? 100 * stats.wait / elapsed : 0., stats.stalls, stats.batches, stats.load);
+}
+
+// Share of the samples whose largest output is the expected class. Every
+// thread of the pool takes a range of the shard of its NUMA node (see
+// DsIdx::place_shards()), and with several nodes reads the copy of the
+// weights in node_weights which a thread of its node made.
+static float test_accuracy(const NN& nn, const Dataset& dataset, int batch, std::vector<NN>& node_weights) {
+    parallel::Pool& pool = parallel::Pool::instance();
+    const int nodes = pool.nodes();
+    if (nodes > 1) {
+        node_weights.resize(nodes);
+        parallel::parallel_each([&](int thread, int) {
+            if (thread == 0 || pool.node(thread - 1) != pool.node(thread)) nn.copy_to(node_weights[pool.node(thread)]);
+        });
+    }
+
+    std::atomic<int> correct{ 0 };
+    parallel::parallel_each([&](int thread, int threads) {
+        static thread_local std::vector<int> indices;
+        static thread_local NN_Matrix inputs, expected;
+        static thread_local NN_Workspace ws;
+
+        // Its rank among the threads of its node.
+        const int node = pool.node(thread);
+        int first_thread = thread, last_thread = thread + 1;
+        while (first_thread > 0 && pool.node(first_thread - 1) == node) first_thread--;
+        while (last_thread < threads && pool.node(last_thread) == node) last_thread++;
+
+        const int shard_first = dataset.shard_begin(node, nodes);
+        const int shard_size = dataset.shard_begin(node + 1, nodes) - shard_first;
+        const int rank = thread - first_thread, ranks = last_thread - first_thread;
+        const int end = shard_first + (int)((long long) shard_size * (rank + 1) / ranks);
+        const NN& weights = (nodes > 1) ? node_weights[node] : nn;
+
+        int thread_correct = 0;
+        for (int first = shard_first + (int)((long long) shard_size * rank / ranks); first < end; first += batch) {
+            int count = std::min(batch, end - first);
+            indices.resize(count);
+            for (int i = 0; i < count; i++) indices[i] = first + i;
+
+            dataset.get_batch(indices, inputs, expected);
+            weights.forward(inputs, ws);
+
+            const NN_Matrix& outputs = ws.outputs.back();
+            for (int r = 0; r < count; r++) {
+                int result = (int) simd::kernels().argmax(outputs.row(r), outputs.cols());
+                if (expected.at(r, result) == 1.f) thread_correct++;
+            }
+        }
+        correct += thread_correct;
+    });
+    return dataset.count() > 0 ? correct / (float) dataset.count() : 0.f;
+}
+
+// The pages allocated on every node since `before`, by its own threads
+// (local) or for them on another node (remote).
+static void print_numa(const std::vector<numa::Stats>& before) {
+    std::vector<numa::Stats> after = numa::stats();
+    printf("NUMA");
+    for (size_t n = 0; n < after.size(); n++) {
+        printf(" | node %d: %lld local, %lld remote pages", numa::topology().nodes[n].id,
+            after[n].local - before[n].local, after[n].other - before[n].other);
+    }
+    printf("\n");
+}
+
+int main(int argc, char** argv) {
+    Options opt;
+    if (!parse_options(argc, argv, opt)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    parallel::Config pool;
+    pool.threads = opt.pool_threads;
+    // The ranks of --procs share the cores.
+    if (pool.threads == 0 && getenv("NN_THREADS") == NULL && opt.procs > 1) {
+        pool.threads = std::max(1, (int) std::thread::hardware_concurrency() / opt.procs);
+    }
+    pool.pin = opt.pin;
+    pool.numa = opt.numa;
+    parallel::configure(pool);
+
+    std::string train_labels = opt.data + "/train-labels.idx1-ubyte";
+    std::string train_images = opt.data + "/train-images.idx3-ubyte";
+    std::string test_labels = opt.data + "/t10k-labels.idx1-ubyte";
+    std::string test_images = opt.data + "/t10k-images.idx3-ubyte";
+
+    const bool stream = opt.stream_mb > 0;
+    auto check = stream ? DsIdxStream::check : DsIdx::check;
+    std::string error = check(train_labels.c_str(), train_images.c_str());
+    if (error.empty()) error = check(test_labels.c_str(), test_images.c_str());
+    if (!error.empty()) {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    // Mapped, or streamed with --stream.
+    std::unique_ptr<DsIdx> idx_train, idx_test;
+    std::unique_ptr<DsIdxStream> stream_train, stream_test;
+    if (stream) {
+        size_t cache = (size_t) opt.stream_mb << 20;
+        stream_train.reset(new DsIdxStream(train_labels.c_str(), train_images.c_str(), cache));
+        stream_test.reset(new DsIdxStream(test_labels.c_str(), test_images.c_str(), cache));
+    } else {
+        idx_train.reset(new DsIdx(train_labels.c_str(), train_images.c_str()));
+        idx_test.reset(new DsIdx(test_labels.c_str(), test_images.c_str()));
+        if (opt.cache && !(idx_train->use_cache((train_images + ".f32").c_str()) &&
+                           idx_test->use_cache((test_images + ".f32").c_str()))) {
+            fprintf(stderr, "Cannot write the input cache in %s\n", opt.data.c_str());
+        }
+        idx_train->advise(!opt.shuffle);
+        idx_test->advise(true);
+    }
+    const Dataset& dset_train = stream ? (const Dataset&) *stream_train : *idx_train;
+    const Dataset& dset_test = stream ? (const Dataset&) *stream_test : *idx_test;
+    const int input_size = stream ? stream_train->input_size() : idx_train->input_size();
+    const int output_size = stream ? stream_train->output_size() : idx_train->classes;
+    printf("Loaded %d training and %d test samples in %.2fs\n",
+        dset_train.count(), dset_test.count(), seconds_since(start));
+
+    if (opt.load != nullptr && !DsIdx::readable(opt.load)) {
+        fprintf(stderr, "Cannot open %s\n", opt.load);
+        return 1;
+    }
+    // The neurons of the network, to check it before it's built.
+    std::vector<int> layers = (opt.load != nullptr) ? NN::saved_layers(opt.load) : opt.layers;
+    if (layers.empty()) {
+        fprintf(stderr, "Cannot read %s\n", opt.load);
+        return 1;
+    }
+    if (layers.front() != input_size || layers.back() != output_size) {
+        fprintf(stderr, "The network doesn't fit the dataset (%d inputs, %d outputs)\n",
+            input_size, output_size);
+        return 1;
+    }
+
+    // The ranks are forked with the dataset mapped, before anything can start
+    // the threads of the pool (the NUMA setup, the first touch of the
+    // weights), and each builds the same network from the seed or the file.
+    // Rank 0 reports, tests and saves.
+    int rank = 0;
+#if defined(__linux__)
+    ShmRing ring(opt.procs, RingTrainer::ring_size(layers));
+    if (opt.procs > 1) rank = ring.fork_ranks();
+#endif
+
+    std::vector<NN> node_weights;
+    std::vector<numa::Stats> numa_stats = numa::stats();
+    if (opt.numa) {
+        const int nodes = parallel::Pool::instance().nodes();
+        // A streamed dataset has no pages of its own to move.
+        if (!stream && nodes > 1 && !(idx_train->place_shards(nodes) && idx_test->place_shards(nodes))) {
+            fprintf(stderr, "Cannot move the dataset to the NUMA nodes\n");
+        }
+        if (rank == 0) {
+            printf("NUMA: %d of %d nodes for %d threads", nodes, numa::topology().count(), parallel::Pool::instance().size());
+            if (!stream) {
+                DsBytes inputs = idx_test->input_bytes();
+                std::vector<size_t> pages = numa::pages_per_node(inputs.data(), inputs.size());
+                printf(" | test set pages per node:");
+                for (size_t count : pages) printf(" %zu", count);
+            }
+            printf("\n");
+        }
+    }
+
+    srand(opt.seed);
+
+    NN nn;
+    if (opt.load != nullptr) {
+        nn.load(opt.load);
+    } else {
+        std::vector<std::string> output_labels;
+        for (int i = 0; i < opt.layers.back(); i++) output_labels.push_back(std::to_string(i));
+        nn = NN(opt.layers, output_labels);
+    }
+    nn.learn_rate = opt.learn_rate;
+    nn.sigmoid_mode = opt.sigmoid_mode;
+
+    // The test set goes through in batches of 256.
+    nn.reserve_batch(std::max(opt.batch, 256));
+
+    std::vector<int> order(dset_train.count());
+    for (int i = 0; i < (int) order.size(); i++) order[i] = i;
+    std::mt19937 rng(opt.seed);
+    Hogwild hogwild(nn, opt.threads);
+    DataParallel data_parallel(nn, opt.replicas);
+
+#if defined(__linux__)
+    RingTrainer ring_trainer(nn, ring, rank);
+
+    // Shards of the same size, the few samples left over are skipped.
+    int shard_size = (int) order.size() / opt.procs;
+    std::vector<int> shard;
+#endif
+
+    // Its threads start here, after the fork.
+    std::unique_ptr<Pipeline> pipeline;
+    if (opt.stages > 1) pipeline.reset(new Pipeline(nn, opt.stages, opt.micro_batches));
+    std::unique_ptr<BatchLoader> loader;
+    const bool prefetch = opt.prefetch > 0;
+    if (prefetch) loader.reset(new BatchLoader(dset_train, opt.prefetch, opt.loaders));
+
+    for (int epoch = 0; epoch < opt.epochs; epoch++) {
+        if (opt.shuffle) std::shuffle(order.begin(), order.end(), rng);
+
+        start = std::chrono::steady_clock::now();
+        float cost;
+        size_t samples = order.size();
+        if (opt.threads > 1) cost = hogwild.train_epoch(dset_train, order, opt.batch);
+        else if (opt.replicas > 1) cost = data_parallel.train_epoch(dset_train, order, opt.batch);
+        else if (opt.stages > 1 && prefetch) cost = pipeline->train_epoch(*loader, order, opt.batch);
+        else if (opt.stages > 1) cost = pipeline->train_epoch(dset_train, order, opt.batch);
+#if defined(__linux__)
+        else if (opt.procs > 1) {
+            shard.assign(order.begin() + rank * shard_size, order.begin() + (rank + 1) * shard_size);
+            cost = ring_trainer.train_epoch(dset_train, shard, opt.batch);
+            samples = (size_t) shard_size * opt.procs;
+        }
+#endif
+        else if (prefetch) cost = train_epoch(nn, *loader, order, opt.batch);
+        else cost = train_epoch(nn, dset_train, order, opt.batch);
+        double elapsed = seconds_since(start);
+        nn.trained++;
+
+        if (rank != 0) continue;
+        printf("Epoch %d | Cost: %.6f | %.2fs, %.0f samples/s | Test accuracy: %.2f%%\n",
+            nn.trained, cost, elapsed, samples / elapsed,
+            100.f * test_accuracy(nn, dset_test, 256, node_weights));
+        if (prefetch) print_loader(*loader, elapsed);
+        if (opt.numa) {
+            print_numa(numa_stats);
+            numa_stats = numa::stats();
+        }
+        fflush(stdout);
+    }
+
+    if (rank != 0) return 0;
+#if defined(__linux__)
+    if (!ring.wait_ranks()) {
+        fprintf(stderr, "A training process failed\n");
+        return 1;
+    }
+#endif
+
+    if (opt.epochs == 0) {
+        printf("Test accuracy: %.2f%%\n", 100.f * test_accuracy(nn, dset_test, 256, node_weights));
+    }
+
+    if (opt.save != nullptr) {
+        nn.data_index = 0;
+        nn.save(opt.save);
+        printf("Saved to %s\n", opt.save);
+    }
+
+    return 0;
+}
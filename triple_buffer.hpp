@@ -0,0 +1,42 @@
+#pragma once
+
+#ifndef TRIPLE_BUFFER_HPP_INCLUDED
+#define TRIPLE_BUFFER_HPP_INCLUDED
+
+#include <atomic>
+
+// Hands the latest value from one writer thread to one reader thread without
+// locks, and without either ever waiting for the other.
+//
+// There are three slots: one the writer fills, one the reader looks at, and
+// the one in between (the back). publish() swaps the written slot with the
+// back, update() swaps the back with the read slot if something new was
+// published since. Each side only touches its own slot, so the reader never
+// sees a value which is half written, it just may skip some.
+template <class T>
+class TripleBuffer {
+public:
+  // Writer side.
+  T& write_buffer() { return _slots[_write]; }
+  void publish() {
+    _write = _back.exchange(_write | FRESH, std::memory_order_acq_rel) & INDEX;
+  }
+
+  // Reader side. Returns whether read() changed.
+  bool update() {
+    if ((_back.load(std::memory_order_relaxed) & FRESH) == 0) return false;
+    _read = _back.exchange(_read, std::memory_order_acq_rel) & INDEX;
+    return true;
+  }
+  const T& read() const { return _slots[_read]; }
+
+private:
+  enum { INDEX = 3, FRESH = 4 };
+
+  T _slots[3];
+  int _write = 0;
+  int _read = 1;
+  std::atomic<int> _back{2};
+};
+
+#endif // TRIPLE_BUFFER_HPP_INCLUDED
@@ -29,6 +29,14 @@ class UI {
   void push_error(float value);
   void set_texture(Texture* texture);
 
+  // The network the graph, the neuron info and the progress are drawn from,
+  // the trained one by default. While it trains on another thread this is
+  // a snapshot of it, see worker.hpp.
+  void set_view(const NN* view);
+
+  // Whether the training is a single step of the "iter" button.
+  bool iterating() const;
+
 
   State get_state() const;
   void set_state(State state);
@@ -60,8 +68,10 @@ private:
   void _check_box(Rectangle area, const char* label, bool* active);
 
   State state = State::IDLE;
+  bool iter = false;
 
   NN* nn = nullptr;
+  const NN* view = nullptr;
   DsMinist* dset_train = nullptr;
   DsMinist* dset_test = nullptr;
 
@@ -119,7 +129,7 @@ private:
 };
 
 UI::UI(NN* nn, DsMinist* dset_train, DsMinist* dset_test)
-  : nn(nn), dset_train(dset_train), dset_test(dset_test) {
+  : nn(nn), view(nn), dset_train(dset_train), dset_test(dset_test) {
 
   cam_nn = { 0 };
   update();
@@ -208,7 +218,8 @@ void UI::handle_inputs() {
 
 
 Color UI::_interpolated_color(Color from, Color to, float weight) {
-  weight = 1.f / (1.f + expf(-weight));
+  // A colour doesn't need more than the saturating approximation.
+  weight = sigmoid(weight, simd::SIGMOID_SATURATE);
   Color r;
   r.r = (unsigned char) Lerp(from.r, to.r, weight);
   r.g = (unsigned char) Lerp(from.g, to.g, weight);
@@ -407,8 +418,6 @@ void UI::draw_inputs() {
     }
   }
 
-  // FIXME:
-  static bool iter = false;
   if (iter) {
     iter = false;
     state = IDLE;
@@ -438,7 +447,7 @@ void UI::draw_inputs() {
   { // Save btn.
     comp_area.y += comp_area.height + padding;
     if (GuiButton(comp_area, "save model") && state != DRAWING) {
-      nn->save("nn");
+      view->save("nn");
       message("Model saved to \"./nn\"!");
     }
   }
@@ -446,8 +455,13 @@ void UI::draw_inputs() {
   { // Load btn.
     comp_area.y += comp_area.height + padding;
     if (GuiButton(comp_area, "load model") && state != DRAWING) {
-      nn->load("nn");
-      message("Model loaded from \"./nn\"!");
+      // The network is the training thread's until it's paused.
+      if (state == TRAINING) {
+        message("Pause the training to load a model!");
+      } else {
+        nn->load("nn");
+        message("Model loaded from \"./nn\"!");
+      }
     }
   }
 
@@ -463,7 +477,7 @@ void UI::draw_inputs() {
 void UI::draw_neuron_info() {
   if (selected_neuron.x < 0 || selected_neuron.y < 0) return;
 
-  const Layer& layer = nn->layers[(int)selected_neuron.x];
+  const Layer& layer = view->layers[(int)selected_neuron.x];
   matrix_t activation = layer.outputs.at(0, (int)selected_neuron.y);
   matrix_t biased = layer.biased.at(0, (int)selected_neuron.y);
 
@@ -485,7 +499,7 @@ void UI::draw_neuron_info() {
   DrawText((std::string("Biased: ") + std::to_string(biased)).c_str(), pos.x, pos.y, font_size, BLACK);
 
   if (selected_neuron.x > 0) {
-    const Layer& prev = nn->layers[(int)(selected_neuron.x - 1)];
+    const Layer& prev = view->layers[(int)(selected_neuron.x - 1)];
     for (int i = 0; i < prev.weights.rows(); i++) {
       matrix_t a = prev.outputs.at(0, i);
       matrix_t w = prev.weights.at(i, (int)selected_neuron.y);
@@ -533,7 +547,7 @@ void UI::draw_progress() {
   float progress = 0.f;
 
   if (dset_train && dset_train->count() > 0) {
-    progress = (nn->data_index) / (float) dset_train->count();
+    progress = (view->data_index) / (float) dset_train->count();
   }
 
   DrawRectangle(area.x, area.y, area.width, area.height, color_pannel);
@@ -655,7 +669,21 @@ void UI::set_state(UI::State state) {
 }
 
 
+void UI::set_view(const NN* view) {
+  this->view = view;
+}
+
+
+bool UI::iterating() const {
+  return iter;
+}
+
+
 void UI::render() {
+  // The canvas forwards on the network, it waits for a frame in the drawing
+  // state so the training is paused (see main.cpp) before it does.
+  State frame_state = state;
+
   draw_nn_graph();
   draw_error_graph();
   draw_texture();
@@ -664,7 +692,7 @@ void UI::render() {
   draw_neuron_info();
   draw_message();
 
-  if (state == State::DRAWING) {
+  if (state == State::DRAWING && frame_state == State::DRAWING) {
     draw_drawing_canvas();
   }
 }
@@ -685,7 +713,7 @@ void UI::draw_nn_graph() {
   Vector2 mouse_pos_graph = GetScreenToWorld2D(GetMousePosition(), cam_nn);
 
   int max_activation_count = 0;
-  for (const Layer& layer : nn->layers) {
+  for (const Layer& layer : view->layers) {
     max_activation_count = std::max(max_activation_count, layer.outputs.cols());
   }
 
@@ -693,12 +721,12 @@ void UI::draw_nn_graph() {
   float max_layer_height = (max_activation_count - 1) * (neuron_gap + 2 * neuron_radius);
 
   // We'll draw from here to make sure the NN is in the middle of the view.
-  float offset_x = (area_nn.width - ((nn->layers.size() - 1) * layer_gap)) / 2.f;
+  float offset_x = (area_nn.width - ((view->layers.size() - 1) * layer_gap)) / 2.f;
   float offset_y = (area_nn.height - max_layer_height) / 2.f;
 
   // Returns the position of a neuron.
   auto get_pos = [=](int layer_index, int neuron_index) {
-    int cols = nn->layers[layer_index].outputs.cols();
+    int cols = view->layers[layer_index].outputs.cols();
     float curr_layer_height = (cols - 1) * (neuron_gap + 2 * neuron_radius);
     float x = offset_x + layer_gap * layer_index;
     float y = offset_y + (max_layer_height - curr_layer_height) / 2.f;
@@ -714,19 +742,19 @@ void UI::draw_nn_graph() {
   {
 
     // Draw connections.
-    for (int layer_index = (int)(nn->layers.size()) - 1; layer_index >= 0; layer_index--) {
-      const Layer& layer = nn->layers[layer_index];
+    for (int layer_index = (int)(view->layers.size()) - 1; layer_index >= 0; layer_index--) {
+      const Layer& layer = view->layers[layer_index];
 
       for (int neuron_index = 0; neuron_index < layer.outputs.cols(); neuron_index++) {
         Vector2 pos = get_pos(layer_index, neuron_index);
         Vector2 screen_pos = GetWorldToScreen2D({ pos.x, pos.y }, cam_nn);
         if (CheckCollisionPointRec(screen_pos, area_nn)) {
           if (layer_index > 0) {
-            int prev_cols = nn->layers[layer_index - 1].outputs.cols();
+            int prev_cols = view->layers[layer_index - 1].outputs.cols();
             for (int j = 0; j < prev_cols; j++) {
               Vector2 pos_prev = get_pos(layer_index - 1, j);
 
-              matrix_t w = nn->layers[layer_index - 1].weights.at(j, neuron_index);
+              matrix_t w = view->layers[layer_index - 1].weights.at(j, neuron_index);
               Color color = _interpolated_color(color_conn_min, color_conn_max, w);
               DrawLineEx(pos_prev, pos, 1, color);
             }
@@ -737,8 +765,8 @@ void UI::draw_nn_graph() {
     }
 
     // Draw the neuron.
-    for (int layer_index = (int)(nn->layers.size()) - 1; layer_index >= 0; layer_index--) {
-      const Layer& layer = nn->layers[layer_index];
+    for (int layer_index = (int)(view->layers.size()) - 1; layer_index >= 0; layer_index--) {
+      const Layer& layer = view->layers[layer_index];
 
       // Get the maximum confident neuron.
       int confident_neuron_index = -1;
@@ -788,9 +816,9 @@ void UI::draw_nn_graph() {
             20,
             BLACK);
 
-          if (layer_index == nn->layers.size() - 1) {
+          if (layer_index == view->layers.size() - 1) {
             DrawText(
-              nn->output_labels[neuron_index].c_str(),
+              view->output_labels[neuron_index].c_str(),
               pos.x + neuron_radius + padding,
               pos.y - 15,
               40,
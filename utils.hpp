@@ -8,11 +8,13 @@
 #include <stdlib.h>
 #include <stdint.h>
 
+#include "dataset.hpp"
+
 typedef Image GrayImage;
 
 typedef unsigned char data_t;
 
-GrayImage gen_image_gray(int width, int height, data_t* data) {
+GrayImage gen_image_gray(int width, int height, const data_t* data) {
     data_t* pixels = (data_t*)RL_CALLOC(width * height, sizeof(data_t));
     for (int i = 0; i < width * height; i++)
         pixels[i] = data[i];
@@ -26,60 +28,35 @@ GrayImage gen_image_gray(int width, int height, data_t* data) {
 }
 
 
-class Dataset {
-public:
-    virtual int count() const = 0;
-    virtual NN_Matrix get_input(int index) const = 0;
-    virtual NN_Matrix get_output(int index) const = 0;
-};
-
-
-class DsMinist : public Dataset {
+// The MNIST dataset of dataset.hpp, with the samples as images for the UI
+// to draw.
+class DsMinist : public DsIdx {
 public:
     DsMinist(const char* path_labels, const char* path_images);
-    ~DsMinist();
 
-    std::vector<uint8_t> labels;
-    std::vector<GrayImage> images;
-
-    int count() const override;
-
-    NN_Matrix get_input(int index) const override;
-    NN_Matrix get_output(int index) const override;
+    // Sample index as an image on the pixels of the dataset, made when the
+    // UI asks for it: it's valid as long as the dataset and must not be
+    // unloaded or resized (copy it with ImageCopy() for that).
+    GrayImage gray_image(int index) const;
 
     static NN_Matrix image_to_input(GrayImage* image);
 
 private:
     static NN_Matrix _image_to_input(const GrayImage* image);
-    void _reserve(int size);
 };
 
-typedef unsigned char data_t;
-
-void DsMinist::_reserve(int size) {
-    labels.reserve(size);
-    images.reserve(size);
-}
+DsMinist::DsMinist(const char* path_labels, const char* path_images)
+  : DsIdx(path_labels, path_images) {}
 
-int DsMinist::count() const {
-    return (int) labels.size();
-}
-
-DsMinist::~DsMinist() {
-    for (size_t i = 0; i < images.size(); i++) {
-        UnloadImage(images[i]);
-    }
-}
-
-NN_Matrix DsMinist::get_input(int index) const {
-    const GrayImage& image = images[index];
-    return _image_to_input(&image);
-}
-
-NN_Matrix DsMinist::get_output(int index) const {
-  NN_Matrix output(1, 10);
-  output.set(0, labels[index], 1.f);
-  return output;
+GrayImage DsMinist::gray_image(int index) const {
+    assert(index >= 0 && index < count());
+    Image image;
+    image.data = (void*) this->image(index);
+    image.width = image_cols;
+    image.height = image_rows;
+    image.format = PIXELFORMAT_UNCOMPRESSED_GRAYSCALE;
+    image.mipmaps = 1;
+    return image;
 }
 
 NN_Matrix DsMinist::image_to_input(GrayImage* image) {
@@ -94,71 +71,11 @@ NN_Matrix DsMinist::_image_to_input(const GrayImage* image) {
   assert(image->width == 28 && image->height == 28);
 
   NN_Matrix m(1, image->height * image->width);
-  std::vector<matrix_t>& data = m.data();
-  for (size_t i = 0; i < data.size(); i++) {
-    data[i] = (matrix_t)(*((data_t*)(image->data) + i)) / 255.f;
+  const data_t* pixels = (const data_t*) image->data;
+  for (int i = 0; i < m.cols(); i++) {
+    m.set(0, i, (matrix_t) pixels[i] / 255.f);
   }
   return m;
 }
 
-
-DsMinist::DsMinist(const char* path_labels, const char* path_images) {
-
-#define READ_INT(dst, ptr)        \
-  do {                            \
-    (dst) = 0;                    \
-    (dst) |= (*(ptr)++) << 8 * 3; \
-    (dst) |= (*(ptr)++) << 8 * 2; \
-    (dst) |= (*(ptr)++) << 8 * 1; \
-    (dst) |= (*(ptr)++) << 8 * 0; \
-  } while (0)
-
-  // Load the labels.
-  {
-    int bytes_read;
-    data_t* data = LoadFileData(path_labels, &bytes_read);
-    data_t* ptr = data;
-
-    uint32_t magic = 0;
-    READ_INT(magic, ptr);
-    assert(magic == 2049);
-
-    uint32_t size = 0;
-    READ_INT(size, ptr);
-    _reserve(size);
-
-    for (uint32_t i = 0; i < size; i++) {
-      labels.push_back(ptr[i]);
-    }
-
-    UnloadFileData(data);
-  }
-
-  // Load the imges.
-  {
-    int bytes_read;
-    data_t* data = LoadFileData(path_images, &bytes_read);
-    data_t* ptr = data;
-
-    uint32_t magic = 0;
-    READ_INT(magic, ptr);
-    assert(magic == 2051);
-
-    uint32_t size, rows, cols;
-    READ_INT(size, ptr);
-    READ_INT(rows, ptr);
-    READ_INT(cols, ptr);
-
-    for (uint32_t i = 0; i < size; i++) {
-      Image img = gen_image_gray(cols, rows, ptr);
-      images.push_back(img);
-      ptr += (cols * rows);
-    }
-
-    UnloadFileData(data);
-}
-
-#undef READ_INT
-}
-
 #endif // UTILS_HPP_INCLUDED
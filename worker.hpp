@@ -0,0 +1,186 @@
+#pragma once
+
+#ifndef WORKER_HPP_INCLUDED
+#define WORKER_HPP_INCLUDED
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "nn.hpp"
+#include "dataset.hpp"
+#include "triple_buffer.hpp"
+
+// What the UI gets to draw while the network is training.
+struct TrainingSnapshot {
+  NN nn;            // Weights and the activations of the last sample.
+  float cost = 0;   // Mean cost of the samples since the previous snapshot.
+  int samples = 0;  // How many there were.
+};
+
+// Trains a network on its own thread, as fast as it goes, one sample at a
+// time through the dataset for the given number of epochs. Every
+// publish_interval it copies the network into a snapshot for the UI, which
+// reads it whenever it renders (see TripleBuffer), so the frame rate and the
+// training speed don't depend on each other.
+//
+// The network belongs to the worker while it runs, pause() (which waits for
+// the current sample to finish) gives it back.
+class TrainingWorker {
+public:
+  TrainingWorker(NN& nn, const Dataset& dataset, int epochs);
+  ~TrainingWorker();
+
+  // Trains samples more samples, or until pause() with samples < 0. The
+  // network is published first, so a snapshot is ready once this returns.
+  void resume(int samples = -1);
+  void pause();
+
+  bool running() const;
+  // The last run stopped at the end of the last epoch, until the next
+  // pause() or resume().
+  bool finished() const;
+
+  TripleBuffer<TrainingSnapshot> snapshots;
+  std::chrono::milliseconds publish_interval{ 8 };
+
+private:
+  void _run();
+  bool _step();
+  void _publish();
+
+  NN& nn;
+  const Dataset& dataset;
+  const int epochs;
+
+  NN_Matrix input;
+  NN_Matrix expected;
+  double cost_sum = 0;
+  int cost_count = 0;
+
+  std::mutex mutex;
+  std::condition_variable cond;
+  std::atomic<int> budget{ 0 }; // Samples left, negative is unlimited.
+  std::atomic<bool> active{ false };
+  std::atomic<bool> done{ false };
+  bool stop = false;
+
+  std::thread thread;
+};
+
+TrainingWorker::TrainingWorker(NN& nn, const Dataset& dataset, int epochs)
+  : nn(nn), dataset(dataset), epochs(epochs) {
+  thread = std::thread(&TrainingWorker::_run, this);
+}
+
+TrainingWorker::~TrainingWorker() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stop = true;
+    budget = 0;
+  }
+  cond.notify_all();
+  thread.join();
+}
+
+void TrainingWorker::resume(int samples) {
+  if (samples == 0) return;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    // The thread is idle, so the network can be copied from here, there is
+    // a snapshot of it from the moment it runs.
+    if (!active) _publish();
+
+    done = false;
+    active = true;
+    budget = samples;
+  }
+  cond.notify_all();
+}
+
+void TrainingWorker::pause() {
+  std::unique_lock<std::mutex> lock(mutex);
+  budget = 0;
+  cond.wait(lock, [&] { return !active; });
+  done = false;
+}
+
+bool TrainingWorker::running() const {
+  return active;
+}
+
+bool TrainingWorker::finished() const {
+  return done;
+}
+
+// One sample, false once the last epoch is over.
+bool TrainingWorker::_step() {
+  if (nn.data_index == dataset.count()) {
+    nn.trained++;
+    if (nn.trained >= epochs) return false;
+    nn.data_index = 0;
+  }
+
+  dataset.get_input_into(nn.data_index, input);
+  dataset.get_output_into(nn.data_index, expected);
+
+  nn.forward(input);
+  cost_sum += (nn.get_outputs() - expected).square().sum() / expected.cols();
+  cost_count++;
+  nn.backprop(expected);
+
+  nn.data_index++;
+  return true;
+}
+
+void TrainingWorker::_publish() {
+  TrainingSnapshot& snapshot = snapshots.write_buffer();
+  nn.copy_to(snapshot.nn);
+  snapshot.cost = (cost_count > 0) ? (float)(cost_sum / cost_count) : 0.f;
+  snapshot.samples = cost_count;
+  snapshots.publish();
+
+  cost_sum = 0;
+  cost_count = 0;
+}
+
+void TrainingWorker::_run() {
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cond.wait(lock, [&] { return stop || budget != 0; });
+      if (stop) return;
+    }
+
+    auto last_publish = std::chrono::steady_clock::now();
+    for (;;) {
+      int left = budget;
+      if (left == 0) break;
+
+      if (!_step()) {
+        done = true;
+        budget = 0;
+        break;
+      }
+      // Don't bring back a budget pause() just cleared.
+      if (left > 0) budget.compare_exchange_strong(left, left - 1);
+
+      auto now = std::chrono::steady_clock::now();
+      if (now - last_publish >= publish_interval) {
+        _publish();
+        last_publish = now;
+      }
+    }
+    _publish();
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (budget == 0) active = false;
+    }
+    cond.notify_all();
+  }
+}
+
+#endif // WORKER_HPP_INCLUDED